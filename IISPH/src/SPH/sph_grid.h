@@ -3,6 +3,20 @@
 #include "sph_types.h"
 
 #include <vector>
+#include <cstdint>
+
+// particle position stored as its grid cell and a 16-bit fixed-point offset inside that cell
+#pragma pack(push, 2)
+struct QuantizedPosition {
+    uint32_t       cell;        // cell coordinates packed on 11 | 11 | 10 bits
+    unsigned short offset[3];   // position inside the cell, in 1/65536 of the cell size
+
+    bool operator==(const QuantizedPosition& r) const {
+        return cell == r.cell && offset[0] == r.offset[0] && offset[1] == r.offset[1] && offset[2] == r.offset[2];
+    }
+    bool operator!=(const QuantizedPosition& r) const { return !((*this) == r); }
+};
+#pragma pack(pop)
 
 class GridHelper {
 public:
@@ -28,6 +42,38 @@ public:
     const inline Real sizeZ() const { return _gridSize.z; }
     const inline Vec3f size() const { return _gridSize; }
 
+    /*-------------------------------------------Periodic axes----------------------------------------------*/
+
+    // periodic axes wrap around the span of the grid cells instead of ending at walls
+    void setPeriodic(bool x, bool y, bool z) { _periodic = Vec3i(x, y, z); }
+    const inline bool isPeriodic() const { return _periodic.x || _periodic.y || _periodic.z; }
+    const inline Real period(int d) const { return _gridRes[d] * _cellSize; }
+
+    // position brought back inside the grid along periodic axes
+    template<class T>
+    Vector3<T> wrap(Vector3<T> particle) const {
+        for (int d = 0; d < 3; d++)
+            if (_periodic[d])
+                particle[d] -= (T)period(d) * std::floor(particle[d] / (T)period(d));
+        return particle;
+    }
+
+    // shortest offset between two wrapped positions
+    template<class T>
+    Vector3<T> minimumImage(Vector3<T> offset) const {
+        for (int d = 0; d < 3; d++)
+            if (_periodic[d]) {
+                T half = (T)0.5f * (T)period(d);
+                if (offset[d] > half)
+                    offset[d] -= (T)period(d);
+                else if (offset[d] < -half)
+                    offset[d] += (T)period(d);
+            }
+        return offset;
+    }
+
+    /*-------------------------------------------Neighbor cells---------------------------------------------*/
+
     void getNeighborCells(std::vector<Index>& neighbors, Vec3f particle, const float radius) {
         if (!isInsideGrid(particle)) {
             neighbors.clear();
@@ -37,12 +83,10 @@ public:
         Vec3i minCell = cellPos(particle - radius);
         Vec3i maxCell = cellPos(particle + radius);
 
-        int imin = std::max(minCell.x, 0);
-        int imax = std::min(maxCell.x, _gridRes.x - 1);
-        int jmin = std::max(minCell.y, 0);
-        int jmax = std::min(maxCell.y, _gridRes.y - 1);
-        int kmin = std::max(minCell.z, 0);
-        int kmax = std::min(maxCell.z, _gridRes.z - 1);
+        int imin, imax, jmin, jmax, kmin, kmax;
+        cellRange(0, minCell.x, maxCell.x, imin, imax);
+        cellRange(1, minCell.y, maxCell.y, jmin, jmax);
+        cellRange(2, minCell.z, maxCell.z, kmin, kmax);
 
         int count = 0;
         int size = (kmax - kmin + 1) * (jmax - jmin + 1) * (imax - imin + 1);
@@ -51,11 +95,27 @@ public:
         for (int k = kmin; k <= kmax; ++k)
             for (int j = jmin; j <= jmax; ++j)
                 for (int i = imin; i <= imax; ++i) {
-                        neighbors[count] = cellID(i, j, k);
+                        neighbors[count] = cellID(wrapCell(0, i), wrapCell(1, j), wrapCell(2, k));
                         count++;
                 }
     }
 
+    // true as soon as the predicate holds for a cell of the 3x3x3 block around (i, j, k)
+    template<class F>
+    bool anyAdjacentCell(int i, int j, int k, F predicate) {
+        int imin, imax, jmin, jmax, kmin, kmax;
+        cellRange(0, i - 1, i + 1, imin, imax);
+        cellRange(1, j - 1, j + 1, jmin, jmax);
+        cellRange(2, k - 1, k + 1, kmin, kmax);
+
+        for (int dk = kmin; dk <= kmax; dk++)
+            for (int dj = jmin; dj <= jmax; dj++)
+                for (int di = imin; di <= imax; di++)
+                    if (predicate(cellID(wrapCell(0, di), wrapCell(1, dj), wrapCell(2, dk))))
+                        return true;
+        return false;
+    }
+
     Index cellID(Vec3f particle) {
         Vec3i cell = cellPos(particle);
         return cellID(cell.x, cell.y, cell.z);
@@ -82,8 +142,79 @@ public:
         return cell;
     }
 
+    /*---------------------------------------Quantized positions--------------------------------------------*/
+
+    bool canQuantize() const {
+        return _gridRes.x <= 0x7FF && _gridRes.y <= 0x7FF && _gridRes.z <= 0x3FF;
+    }
+
+    template<class T>
+    QuantizedPosition quantize(const Vector3<T>& particle) const {
+        QuantizedPosition q{};
+        int cell[3];
+
+        for (int d = 0; d < 3; d++) {
+            T   scaled = particle[d] / _cellSize;
+            int maxCell = d < 2 ? 0x7FF : 0x3FF;
+            cell[d] = std::min(std::max((int)std::floor(scaled), 0), std::min(_gridRes[d] - 1, maxCell));
+            q.offset[d] = (unsigned short)std::min(std::max((T)std::floor((scaled - cell[d]) * 65536), (T)0), (T)65535);
+        }
+
+        q.cell = (uint32_t)cell[0] | ((uint32_t)cell[1] << 11) | ((uint32_t)cell[2] << 22);
+        return q;
+    }
+
+    template<class T>
+    Vector3<T> dequantize(const QuantizedPosition& q) const {
+        return Vector3<T>(
+            (T)(q.cell & 0x7FF)         * _cellSize + q.offset[0] * (_cellSize / 65536),
+            (T)((q.cell >> 11) & 0x7FF) * _cellSize + q.offset[1] * (_cellSize / 65536),
+            (T)(q.cell >> 22)           * _cellSize + q.offset[2] * (_cellSize / 65536));
+    }
+
+    // exact a - b in fixed point, converted once : precision does not depend on the distance to the origin
+    template<class T>
+    Vector3<T> relativePosition(const QuantizedPosition& a, const QuantizedPosition& b) const {
+        int dx = ((int)(a.cell & 0x7FF)         - (int)(b.cell & 0x7FF))         * 65536 + (a.offset[0] - b.offset[0]);
+        int dy = ((int)((a.cell >> 11) & 0x7FF) - (int)((b.cell >> 11) & 0x7FF)) * 65536 + (a.offset[1] - b.offset[1]);
+        int dz = ((int)(a.cell >> 22)           - (int)(b.cell >> 22))           * 65536 + (a.offset[2] - b.offset[2]);
+
+        // minimum image in fixed point, the period is a whole number of cells
+        if (_periodic.x) dx = wrapQuanta(dx, _gridRes.x * 65536);
+        if (_periodic.y) dy = wrapQuanta(dy, _gridRes.y * 65536);
+        if (_periodic.z) dz = wrapQuanta(dz, _gridRes.z * 65536);
+
+        const T quantum = _cellSize / 65536;
+        return Vector3<T>(dx * quantum, dy * quantum, dz * quantum);
+    }
+
 private:
+    // cells [first, last] along axis d, clamped to the grid or at most one period when the axis wraps
+    void cellRange(int d, int first, int last, int& rangeMin, int& rangeMax) const {
+        if (_periodic[d] && _gridRes[d] >= 3) {
+            rangeMin = first;
+            rangeMax = std::min(last, first + _gridRes[d] - 1);
+        }
+        else {
+            rangeMin = std::max(first, 0);
+            rangeMax = std::min(last, _gridRes[d] - 1);
+        }
+    }
+
+    inline int wrapCell(int d, int cell) const {
+        return _periodic[d] ? (cell % _gridRes[d] + _gridRes[d]) % _gridRes[d] : cell;
+    }
+
+    static inline int wrapQuanta(int offset, int period) {
+        if (offset > period / 2)
+            return offset - period;
+        if (offset < -period / 2)
+            return offset + period;
+        return offset;
+    }
+
     Vec3i _gridRes;
     Vec3f _gridSize;
     Real  _cellSize = 1.0f;
+    Vec3i _periodic = Vec3i(0, 0, 0);   // wrapping axes
 };
@@ -7,14 +7,15 @@
 #endif
 
 // SPH Kernel function : cubic spline
+template <class T = Real>
 class CubicSpline
 {
 public:
-    explicit CubicSpline(const Real h = 1, unsigned int dim = 2) : _dim(dim) {
+    explicit CubicSpline(const T h = 1, unsigned int dim = 2) : _dim(dim) {
         setSmoothingLen(h);
     }
-    void setSmoothingLen(const Real h) {
-        const Real h2 = square(h), h3 = h2 * h;
+    void setSmoothingLen(const T h) {
+        const T h2 = square(h), h3 = h2 * h;
         _h = h;
         _sr = 2e0 * h;
         _c[0] = 2e0 / (3e0 * h);
@@ -25,52 +26,75 @@ public:
         _gc[2] = _c[2] / h;
     }
 
-    Real smoothingLen() const { return _h; }
+    T smoothingLen() const { return _h; }
 
-    Real supportRadius() const { return _sr; }
+    T supportRadius() const { return _sr; }
 
-    Real f(const Real l) const {
-        const Real q = l / _h;
+    T f(const T l) const {
+        const T q = l / _h;
         if (q < 1e0) return _c[_dim - 1] * (1e0 - 1.5 * square(q) + 0.75 * cube(q));
-        else if (q < 2e0) return _c[_dim - 1] * (0.25 * cube(2e0 - q));
+        else if (q < 2e0) return _c[_dim - 1] * (0.25 * cube(2 - q));
         return 0;
     }
 
-    Real derivativeF(const Real l) const {
-        const Real q = l / _h;
+    T derivativeF(const T l) const {
+        const T q = l / _h;
         if (q <= 1e0) return _gc[_dim - 1] * (-3e0 * q + 2.25 * square(q));
-        else if (q < 2e0) return -_gc[_dim - 1] * 0.75 * square(2e0 - q);
+        else if (q < 2e0) return -_gc[_dim - 1] * 0.75 * square(2 - q);
         return 0;
     }
 
-    Real W(const Vec2f& rij) const { return f(rij.length()); }
-    Vec2f gradW(const Vec2f& rij) const { return gradW(rij, rij.length()); }
-    Vec2f gradW(const Vec2f& rij, const Real len) const { return derivativeF(len) * rij / len; }
+    T W(const Vector2<T>& rij) const { return f(rij.length()); }
+    Vector2<T> gradW(const Vector2<T>& rij) const { return gradW(rij, rij.length()); }
+    Vector2<T> gradW(const Vector2<T>& rij, const T len) const { return derivativeF(len) * rij / len; }
 
-    Real W(const Vec3f& rij) const { return f(rij.length()); }
-    Vec3f gradW(const Vec3f& rij) const { return gradW(rij, rij.length()); }
-    Vec3f gradW(const Vec3f& rij, const Real len) const { return derivativeF(len) * rij / len; }
+    T W(const Vector3<T>& rij) const { return f(rij.length()); }
+    Vector3<T> gradW(const Vector3<T>& rij) const { return gradW(rij, rij.length()); }
+    Vector3<T> gradW(const Vector3<T>& rij, const T len) const { return derivativeF(len) * rij / len; }
+
+    // kernel of another smoothing length h, rescaled from the one of _h
+    T scaledW(const Vector3<T>& rij, const T h) const {
+        const T s = _h / h;
+        return dimScale(s) * f(rij.length() * s);
+    }
+    Vector3<T> scaledGradW(const Vector3<T>& rij, const T h) const {
+        const T s = _h / h, len = rij.length();
+        return dimScale(s) * s * derivativeF(len * s) * rij / len;
+    }
 
 private:
+    T dimScale(const T s) const {
+        T scale = s;
+        for (unsigned int d = 1; d < _dim; d++)
+            scale *= s;
+        return scale;
+    }
+
     unsigned int _dim;
-    Real _h, _sr, _c[3], _gc[3];
+    T _h, _sr, _c[3], _gc[3];
 };
 
 
+template <class T = Real>
 class SimpleKernel {
 public:
-    SimpleKernel(const Real h = 1) {
+    SimpleKernel(const T h = 1) {
         _h = h;
     }
 
-    Real k(const Real s) const {
-        return std::max(0.0f, cube(1e0 - square(s)) / (2 * _h));
+    T k(const T s) const {
+        return kSquare(square(s));
+    }
+
+    // same from the squared distance, no square root in vectorized loops
+    T kSquare(const T s2) const {
+        return std::max((T)0, cube(1 - s2) / (2 * _h));
     }
 
-    Real W(const Vec2f& rij) const { return k(rij.length()); }
-    Real W(const Vec3f& rij) const { return k(rij.length()); }
+    T W(const Vector2<T>& rij) const { return k(rij.length()); }
+    T W(const Vector3<T>& rij) const { return k(rij.length()); }
 
 private:
-    Real _h;
+    T _h;
 };
 
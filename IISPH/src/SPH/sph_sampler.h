@@ -64,6 +64,32 @@ public:
         }
 	}
 
+    // faces of the box [bottomLeft, topRight] on a lattice of about the given spacing, stretched to end on the edges
+    // open axes get no end faces and are sampled over [bottomLeft, topRight) so that they wrap seamlessly
+    static void boxSurface(std::vector<Vec3f>& positions, Real spacing, Vec3f bottomLeft, Vec3f topRight, Vec3i open = Vec3i(0, 0, 0)) {
+        int  n[3];
+        Real step[3];
+
+        for (int d = 0; d < 3; d++) {
+            n[d]    = std::max((int)std::ceil((topRight[d] - bottomLeft[d]) / spacing - 1e-4f), 1);
+            step[d] = (topRight[d] - bottomLeft[d]) / n[d];
+        }
+
+        auto onFace = [&](int d, int index) { return !open[d] && (index == 0 || index == n[d]); };
+
+        for (int k = 0; k <= n[2] - open.z; k++)
+            for (int j = 0; j <= n[1] - open.y; j++)
+                for (int i = 0; i <= n[0] - open.x; i++) {
+                    if (!onFace(0, i) && !onFace(1, j) && !onFace(2, k))
+                        continue;
+
+                    positions.push_back(Vec3f(
+                        bottomLeft.x + i * step[0],
+                        bottomLeft.y + j * step[1],
+                        bottomLeft.z + k * step[2]));
+                }
+    }
+
     static void cubeVolume(std::vector<Vec3f>& positions, Real cellSize, Vec3f bottomLeft, Vec3f topRight) {
         Real offset25 = 0.25f * cellSize;
         Real offset50 = 0.50f * cellSize;
@@ -29,7 +29,7 @@ public:
 
         // derived properties
         _m0 = _rho0 * square(_h);
-        _kernel = CubicSpline(_h, 2);
+        _kernel = CubicSpline<>(_h, 2);
     }
 
     void init(const int gridX, const int gridY, const int fluidWidth, const int fluidHeight);
@@ -108,7 +108,7 @@ private:
     /*-------------------------------------------Class members---------------------------------------------------*/
 
     // smooth kernel
-    CubicSpline _kernel;
+    CubicSpline<> _kernel;
 
     // fluid particles data
     std::vector<Vec2f> _fPosition;
@@ -2,65 +2,229 @@
 
 /*--------------------------------------------Main functions--------------------------------------------------*/
 
-void IISPHsolver3D::prepareSolver(std::vector<Vec3f> fluidPos, std::vector<Vec3f> boundaryPos) {
-    // sample input fluid
-    _fPosition = fluidPos;
-    _fluidCount = _fPosition.size();
+template <class T, class A>
+void IISPHsolver3D<T, A>::prepareSolver(std::vector<Vec3f> fluidPos, std::vector<Vec3f> boundaryPos) {
+    // animated boundaries follow the static inner ones
+    for (auto& group : _bGroups) {
+        group.first = boundaryPos.size();
+
+        for (auto& p : group.local)
+            boundaryPos.push_back(Vec3f(group.center + p));
+    }
 
-    // sample input boundaries
-    _bPosition = boundaryPos;
-    _inBoundaryCount = _bPosition.size();
+    // periodic axes wrap around the span of the grid cells
+    _pGridHelper.setPeriodic(_periodicAxes.x != 0, _periodicAxes.y != 0, _periodicAxes.z != 0);
+    _periodicBoundaries = _pGridHelper.isPeriodic();
 
-    // sample global boundaries
-    Sampler::cubeSurface(_bPosition, _pGridHelper.cellSize(), Vec3f(0.0f), _pGridHelper.size(), 1);
-    _boundaryCount = _bPosition.size();
+    // sample global boundaries, walls along a periodic axis run one cell past both ends and are cut at the period
+    _inBoundaryCount = boundaryPos.size();
+
+    if (_boundarySpacing > 1.5f * _h) {
+        std::cout << "boundary spacing above 1.5 h lets fluid through the walls, clamping it" << std::endl;
+        _boundarySpacing = 1.5f * _h;
+    }
+
+    if (_boundarySpacing > 0.0f) {
+        Real  cellSize = _pGridHelper.cellSize();
+        Vec3f bottomLeft, topRight;
+
+        for (int d = 0; d < 3; d++) {
+            bottomLeft[d] = _periodicAxes[d] ? 0.0f : 0.5f * cellSize;
+            topRight[d]   = _periodicAxes[d] ? _pGridHelper.period(d) : _pGridHelper.size()[d] - 0.5f * cellSize;
+        }
+
+        Sampler::boxSurface(boundaryPos, _boundarySpacing, bottomLeft, topRight, _periodicAxes);
+    }
+    else if (_periodicBoundaries) {
+        Real  cellSize = _pGridHelper.cellSize();
+        Vec3f margin(_periodicAxes.x * cellSize, _periodicAxes.y * cellSize, _periodicAxes.z * cellSize);
+
+        std::vector<Vec3f> walls;
+        Sampler::cubeSurface(walls, cellSize, Vec3f(0.0f) - margin, _pGridHelper.size() + margin, 1);
+
+        for (auto& p : walls) {
+            bool inside = true;
+            for (int d = 0; d < 3; d++)
+                if (_periodicAxes[d] && (p[d] < 0.0f || p[d] >= _pGridHelper.period(d)))
+                    inside = false;
+
+            if (inside)
+                boundaryPos.push_back(p);
+        }
+    }
+    else
+        Sampler::cubeSurface(boundaryPos, _pGridHelper.cellSize(), Vec3f(0.0f), _pGridHelper.size(), 1);
+
+    // sample distance field, large domains keep bricks of nodes instead of every node
+    std::vector<Vec3f> surfacePos;
+    int surfaceNodeCount = surfaceNodes(0) * surfaceNodes(1) * surfaceNodes(2);
 
-    // sample distance field
-    Sampler::gridNodes(_sPosition, _sGridHelper.cellSize(), Vec3f(0.0f), _sGridHelper.size());
-    _surfaceCount = _sPosition.size();
+    if (_sparseSurface && _surfaceExtraction == ADAPTIVE_OCTREE) {
+        std::cout << "adaptive octree evaluates its own nodes on the dense field, sparse surface disabled" << std::endl;
+        _sparseSurface = false;
+    }
+
+    if (_sparseSurface && surfaceNodeCount < _denseNodes) {
+        std::cout << "sparse surface : " << surfaceNodeCount << " nodes, dense field kept" << std::endl;
+        _sparseSurface = false;
+    }
+
+    if (_temporalSurface && (_sparseSurface || _surfaceExtraction != MARCHING_CUBES)) {
+        std::cout << "temporal surface needs the dense field and marching cubes, rebuilding every frame" << std::endl;
+        _temporalSurface = false;
+    }
+
+    if (_quantizedSurface && (_sparseSurface || _temporalSurface || _surfaceExtraction == ADAPTIVE_OCTREE)) {
+        std::cout << "quantized surface needs the dense field without temporal or octree updates, keeping full values" << std::endl;
+        _quantizedSurface = false;
+    }
+
+    if (_sparseSurface)
+        _sparseField.resize(surfaceNodes(0), surfaceNodes(1), surfaceNodes(2), 2.0f * _h);
+    else
+        Sampler::gridNodes(surfacePos, _sGridHelper.cellSize(), Vec3f(0.0f), _sGridHelper.size());
+
+    // store samples with solver precision
+    _fPosition.assign(fluidPos.begin(), fluidPos.end());
+    _bPosition.assign(boundaryPos.begin(), boundaryPos.end());
+    _sPosition.assign(surfacePos.begin(), surfacePos.end());
+
+    _fluidCount    = _fPosition.size();
+    _aliveCount    = _fluidCount;
+    _fluidCapacity = std::max(_fluidCapacity, _fluidCount);
+    _boundaryCount = _bPosition.size();
+    _surfaceCount  = _sparseSurface ? surfaceNodeCount : (int)_sPosition.size();
 
     std::cout << "\n"
         << "number of fluid particles    : " << _fluidCount    << "\n"
+        << "fluid pool capacity          : " << _fluidCapacity << "\n"
         << "number of boundary particles : " << _boundaryCount << "\n"
         << "number of surface nodes      : " << _surfaceCount  << "\n"
+        << "storage / accumulation bytes : " << sizeof(T) << " / " << sizeof(A) << "\n"
         << std::endl;
 
     // init smooth kernels
-    _pKernel = CubicSpline(_h, 3);
-    _sKernel = SimpleKernel(_h);
+    _pKernel = CubicSpline<A>(_h, 3);
+    _sKernel = SimpleKernel<A>(_h);
 
     // init other quantities
-    _fDensity      = std::vector<Real> (_fluidCount, 0.0f);
-    _fVelocity     = std::vector<Vec3f>(_fluidCount, Vec3f(0.0f));
-    _fPressure     = std::vector<Real> (_fluidCount, 0.0f);
-    _fColor        = std::vector<Vec3f>(_fluidCount, _denseColor);
+    _fDensity      = std::vector<T>    (_fluidCapacity, 0.0f);
+    _fVelocity     = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _fPressure     = std::vector<T>    (_fluidCapacity, 0.0f);
+    _fColor        = std::vector<Vec3f>(_fluidCapacity, _denseColor);
+    _fPosition.resize(_fluidCapacity, Vec3(0.0f));
     _bColor        = std::vector<Vec3f>(_boundaryCount, _wallColor);
-    _Psi           = std::vector<Real> (_boundaryCount, 0.0f);
-    _Dii           = std::vector<Vec3f>(_fluidCount, Vec3f(0.0f));
-    _Aii           = std::vector<Real> (_fluidCount, 0.0f);
-    _sumDijPj      = std::vector<Vec3f>(_fluidCount, Vec3f(0.0f));
-    _Vadv          = std::vector<Vec3f>(_fluidCount, Vec3f(0.0f));
-    _Dadv          = std::vector<Real> (_fluidCount, 0.0f);
-    _Pl            = std::vector<Real> (_fluidCount, 0.0f);
-    _Dcorr         = std::vector<Real> (_fluidCount, 0.0f);
-    _Fadv          = std::vector<Vec3f>(_fluidCount, Vec3f(0.0f));
-    _Fp            = std::vector<Vec3f>(_fluidCount, Vec3f(0.0f));
-    _distanceField = std::vector<Real> (_surfaceCount, 0.0f);
+    _bVelocity     = std::vector<Vec3> (_boundaryCount, Vec3(0.0f));
+    _Psi           = std::vector<T>    (_boundaryCount, 0.0f);
+    _Dii           = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _Aii           = std::vector<T>    (_fluidCapacity, 0.0f);
+    _sumDijPj      = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _Vadv          = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _Dadv          = std::vector<T>    (_fluidCapacity, 0.0f);
+    _Pl            = std::vector<T>    (_fluidCapacity, 0.0f);
+    _kappa         = std::vector<T>    (_fluidCapacity, 0.0f);
+    _kappaV        = std::vector<T>    (_fluidCapacity, 0.0f);
+    _Vvisc         = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _viscDiagonal  = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _viscResidual  = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _viscDirection = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _viscProduct   = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _Dcorr         = std::vector<T>    (_fluidCapacity, 0.0f);
+    _Fadv          = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _Fp            = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _distanceField = std::vector<T>    (_sparseSurface || _quantizedSurface ? 0 : _surfaceCount, 0.0f);
+    _quantizedField = std::vector<short>(_quantizedSurface ? _surfaceCount : 0, 0);
+    _fSleeping     = std::vector<char> (_fluidCapacity, 0);
+    _fRestSteps    = std::vector<int>  (_fluidCapacity, 0);
+    _activeCells   = std::vector<char> ((size_t)_pGridHelper.cellCount(), 0);
+    _fMass         = std::vector<T>    (_fluidCapacity, _m0);
+    _fSpacing      = std::vector<T>    (_fluidCapacity, _h);
+    _fLevel        = std::vector<char> (_fluidCapacity, 0);
+    _fDensityShift = std::vector<T>    (_fluidCapacity, 0.0f);
+    _fRebalance    = std::vector<char> (_fluidCapacity, 0);
+    _cellDepth     = std::vector<char> ((size_t)_pGridHelper.cellCount(), 0);
+    _fTimeLevel    = std::vector<char> (_fluidCapacity, 0);
+    _cellTimeLevel = std::vector<char> ((size_t)_pGridHelper.cellCount(), 0);
+    _levelCount    = std::vector<int>  (_maxTimeLevel + 1, 0);
+    _fWallVolume   = std::vector<T>    (_fluidCapacity, 0.0f);
+    _fWallGradient = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _fWallCount    = std::vector<T>    (_fluidCapacity, 0.0f);
+    _fSurfaceRef   = std::vector<Vec3> (_fluidCapacity, Vec3(0.0f));
+    _fSurfaceBuilt = std::vector<char> (_fluidCapacity, 0);
+
+    // init particle pool
+    _fState = std::vector<char>(_fluidCapacity, SLOT_FREE);
+    std::fill(_fState.begin(), _fState.begin() + _fluidCount, SLOT_ALIVE);
+    _freeSlots.clear();
+    _freeSlots.reserve(_fluidCapacity);
+
+    for (auto& emitter : _emitters) {
+        emitter.nodes.clear();
+        Sampler::cubeVolume(emitter.nodes, _pGridHelper.cellSize(), emitter.bottomLeft, emitter.topRight);
+    }
+
+    // init temporal surface, the first frame evaluates every block
+    if (_temporalSurface) {
+        if (_surfaceTolerance <= 0.0f)
+            _surfaceTolerance = 0.05f * _h;
+
+        for (int d = 0; d < 3; d++)
+            _surfaceBlocks[d] = (surfaceNodes(d) + IsoSurface<T>::blockSize - 1) >> IsoSurface<T>::blockBits;
+
+        _dirtyBlocks = std::vector<char>((size_t)_surfaceBlocks[0] * _surfaceBlocks[1] * _surfaceBlocks[2], 1);
+        _vacatedRefs.clear();
+    }
+
+    // init quantized positions
+    if (_quantizedPositions && !_pGridHelper.canQuantize()) {
+        std::cout << "grid too large for quantized positions, keeping full positions" << std::endl;
+        _quantizedPositions = false;
+    }
+
+    if (_quantizedPositions) {
+        _fQuantized = std::vector<QuantizedPosition>(_fluidCapacity);
+        _bQuantized = std::vector<QuantizedPosition>(_boundaryCount);
+
+        #pragma omp parallel for
+        for (int i = 0; i < _boundaryCount; i++)
+            _bQuantized[i] = _pGridHelper.quantize(_bPosition[i]);
+    }
 
     // init neighboring system
     _fGrid = std::vector<std::vector<Index>>((size_t)_pGridHelper.cellCount(), std::vector<Index>());
     _bGrid = std::vector<std::vector<Index>>((size_t)_pGridHelper.cellCount(), std::vector<Index>());
     buildNeighborGrid();
 
-    _fNeighbors = std::vector<std::vector<Index>>(_fluidCount, std::vector<Index>());
-    _bNeighbors = std::vector<std::vector<Index>>(_fluidCount, std::vector<Index>());
+    // boundary grid is filled once, animated groups then update their own entries
+    for (int i = 0; i < _boundaryCount; i++)
+        fillBoundaryGrid(i);
+
+    for (auto& group : _bGroups) {
+        group.cells.resize(group.local.size());
+
+        for (size_t k = 0; k < group.local.size(); k++)
+            group.cells[k] = _pGridHelper.cellID(_bPosition[group.first + k]);
+    }
+
+    _fNeighbors = std::vector<std::vector<Index>>(_fluidCapacity, std::vector<Index>());
+    _bNeighbors = std::vector<std::vector<Index>>(_fluidCapacity, std::vector<Index>());
     searchNeighbors();
+    prepareSolverTiles();
 
     // compute density number ones and for all
+    if (_boundarySpacing > 0.0f)
+        calibratePsi();
+
     #pragma omp parallel for
     for (int i = 0; i < _boundaryCount; i++)
         computePsi(i);
 
+    // static walls leave the neighbor search once baked
+    if (_implicitBoundaries) {
+        bakeBoundaryMaps();
+        searchNeighbors();
+    }
+
     // visualize initial fluid density
     #pragma omp parallel for
     for (int i = 0; i < _fluidCount; i++)
@@ -69,43 +233,175 @@ void IISPHsolver3D::prepareSolver(std::vector<Vec3f> fluidPos, std::vector<Vec3f
     visualizeFluidDensity();
 }
 
-void IISPHsolver3D::solveSimulation() {
-    static Real count = 0.5f;
+template <class T, class A>
+int IISPHsolver3D<T, A>::addBoundaryGroup(const std::vector<Vec3f>& positions, Vec3f center) {
+    BoundaryGroup<T> group;
+    group.center          = Vec3(center);
+    group.frame[0]        = Vec3(1.0f, 0.0f, 0.0f);
+    group.frame[1]        = Vec3(0.0f, 1.0f, 0.0f);
+    group.frame[2]        = Vec3(0.0f, 0.0f, 1.0f);
+    group.velocity        = Vec3(0.0f);
+    group.angularVelocity = Vec3(0.0f);
+
+    for (auto& p : positions)
+        group.local.push_back(Vec3(p - center));
+
+    _bGroups.push_back(group);
+    return (int)_bGroups.size() - 1;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::solveSimulation() {
+    static int count = 1;
 
     auto start = Clock::now();
+    moveBoundaries();
+    updatePool();
     buildNeighborGrid();
+    if (_localTimeStepping)
+        updateTimeLevels();
     searchNeighbors();
     std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
     searchNeighborsTime = (elapsed.count() + (count - 1) * searchNeighborsTime) / count;
 
-    start = Clock::now();
-    predictAdvection();
-    elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
-    predictAdvectionTime = (elapsed.count() + (count - 1) * predictAdvectionTime) / count;
+    // with local time stepping, each level due is solved on its own step while the other particles keep their velocity
+    std::chrono::milliseconds predictElapsed(0), solveElapsed(0), integrationElapsed(0);
+    T   substep   = _dt;
+    int lastLevel = _localTimeStepping ? _maxTimeLevel : 0;
 
-    start = Clock::now();
-    pressureSolve();
-    elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
-    solvePressureTime = (elapsed.count() + (count - 1) * solvePressureTime) / count;
+    for (int level = 0; level <= lastLevel; level++) {
+        if (_localTimeStepping) {
+            if (_levelCount[level] == 0)
+                continue;
 
+            _activeLevel = level;
+            _dt = substep * (1 << level);
 
-    start = Clock::now();
-    integration();
-    elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
-    correctPositionTime = (elapsed.count() + (count - 1) * correctPositionTime) / count;
+            // stiffness of frozen particles must not push their neighbors
+            if (_solverMode == DFSPH_SOLVER) {
+#pragma omp parallel for
+                for (int i = 0; i < _fluidCount; i++)
+                    if (!isActive(i))
+                        _Pl[i] = 0.0f;
+            }
+        }
+
+        start = Clock::now();
+        if (_solverMode == DFSPH_SOLVER)
+            predictAdvectionDF();
+        else
+            predictAdvection();
+        predictElapsed += std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+
+        start = Clock::now();
+        if (_solverMode == DFSPH_SOLVER)
+            densitySolve();
+        else
+            pressureSolve();
+        solveElapsed += std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+
+        start = Clock::now();
+        integration();
+        integrationElapsed += std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+    }
+
+    if (_localTimeStepping) {
+        _dt          = substep;
+        _activeLevel = -1;
+
+        start = Clock::now();
+#pragma omp parallel for
+        for (int i = 0; i < _fluidCount; i++)
+            if (isAwake(i))
+                updatePosition(i);
+        integrationElapsed += std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
+
+        _localStep = (_localStep + 1) % (1 << _maxTimeLevel);
+    }
+
+    predictAdvectionTime = (predictElapsed.count()     + (count - 1) * predictAdvectionTime) / count;
+    solvePressureTime    = (solveElapsed.count()       + (count - 1) * solvePressureTime)    / count;
+    correctPositionTime  = (integrationElapsed.count() + (count - 1) * correctPositionTime)  / count;
+
+    if (_sleeping)
+        updateSleeping();
+
+    if (_adaptiveResolution)
+        updateResolution();
 
     visualizeFluidDensity();
-    count += 0.5f;
+    count++;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::advanceFrame(T frameTime) {
+    static int count = 1;
+    int substeps = 0;
+
+    if (!_adaptiveTimeStep) {
+        substeps = std::max((int)std::round(frameTime / _dt), 1);
+
+        for (int i = 0; i < substeps; i++)
+            solveSimulation();
+    }
+
+    else {
+        T remainingTime = frameTime;
+
+        while (remainingTime > 0.0f) {
+            computeTimeStep(remainingTime);
+            solveSimulation();
+            substeps++;
+
+            // last substep lands exactly on the frame boundary
+            if (_dt >= remainingTime)
+                break;
+
+            remainingTime -= _dt;
+        }
+    }
+
+    substepsPerFrame = (substeps + (count - 1) * substepsPerFrame) / count;
+    count++;
 }
 
-void IISPHsolver3D::reconstructSurface() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::reconstructSurface() {
     static int count = 1;
 
     auto start = Clock::now();
 
-    #pragma omp parallel for
-    for (int i = 0; i < _surfaceCount; i++)
-        computeDistanceField(i, 2.0f * _h);
+    // the octree evaluates the corners of its cells while refining them
+    if (_surfaceExtraction == ADAPTIVE_OCTREE) {
+        double evaluated = (double)buildSurfaceOctree();
+        bandNodes = (evaluated / std::max(_surfaceCount, 1) + (count - 1) * bandNodes) / count;
+    }
+    else {
+        // nodes to evaluate : active bricks, dirty blocks, band nodes or the whole grid
+        if (_sparseSurface)
+            updateSurfaceBricks();
+        else if (_temporalSurface)
+            updateDirtyBlocks();
+        else if (_narrowBand)
+            updateSurfaceBand();
+
+        // splatting visits every particle, the few dirty blocks are gathered
+        if (_surfaceSplatting && !_temporalSurface)
+            splatDistanceField(2.0f * _h);
+        else
+            gatherDistanceField(2.0f * _h);
+
+        if (_sparseSurface || (_narrowBand && !_temporalSurface)) {
+            double evaluated = _sparseSurface ? (double)_sparseField.activeCount() * SparseField<T>::brickNodes : (double)_bandNodes.size();
+            bandNodes = (evaluated / std::max(_surfaceCount, 1) + (count - 1) * bandNodes) / count;
+        }
+    }
+
+    if (_temporalSurface)
+        dirtyBlocks = ((double)_dirtyList.size() / _dirtyBlocks.size() + (count - 1) * dirtyBlocks) / count;
+
+    double memory = _sparseSurface ? (double)_sparseField.memoryBytes() : _quantizedSurface ? (double)_quantizedField.size() * sizeof(short) : (double)_distanceField.size() * sizeof(T);
+    surfaceMemory = (memory / (1 << 20) + (count - 1) * surfaceMemory) / count;
 
     std::chrono::milliseconds elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start);
     distanceFieldTime = (elapsed.count() + (count - 1) * distanceFieldTime) / count;
@@ -119,8 +415,9 @@ void IISPHsolver3D::reconstructSurface() {
     count++;
 }
 
-void IISPHsolver3D::showGeneralStatistics() {
-    double sphComputation     = searchNeighborsTime + predictAdvectionTime + solvePressureTime + correctPositionTime;
+template <class T, class A>
+void IISPHsolver3D<T, A>::showGeneralStatistics() {
+    double sphComputation     = substepsPerFrame * (searchNeighborsTime + predictAdvectionTime + solvePressureTime + correctPositionTime);
     double surfaceComputation = distanceFieldTime + marchingCubesTime;
 
     std::cout
@@ -129,12 +426,24 @@ void IISPHsolver3D::showGeneralStatistics() {
         << std::endl;
 }
 
-void IISPHsolver3D::showDetailedStatistics() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::showDetailedStatistics() {
     std::cout
-        << "|    search neighbors  : " << std::setw(6) << searchNeighborsTime  << " ms\n"
-        << "|    predict advection : " << std::setw(6) << predictAdvectionTime << " ms\n"
-        << "|    solve pressure    : " << std::setw(6) << solvePressureTime    << " ms\n"
-        << "|    correct position  : " << std::setw(6) << correctPositionTime  << " ms\n"
+        << "|    substeps          : " << std::setw(6) << substepsPerFrame     << "\n"
+        << "|    search neighbors  : " << std::setw(6) << substepsPerFrame * searchNeighborsTime  << " ms\n"
+        << "|    predict advection : " << std::setw(6) << substepsPerFrame * predictAdvectionTime << " ms\n"
+        << "|    solve pressure    : " << std::setw(6) << substepsPerFrame * solvePressureTime    << " ms\n"
+        << "|    jacobi iterations : " << std::setw(6) << pressureIterations   << "\n"
+        << "|    compressed        : " << std::setw(6) << compressedParticles  << "\n"
+        << "|    divergence iters  : " << std::setw(6) << divergenceIterations << "\n"
+        << "|    viscosity iters   : " << std::setw(6) << viscosityIterations  << "\n"
+        << "|    sleeping          : " << std::setw(6) << sleepingParticles    << "\n"
+        << "|    stepped particles : " << std::setw(6) << steppedParticles     << "\n"
+        << "|    merged / split    : " << std::setw(6) << mergedParticles << " / " << splitParticles << "\n"
+        << "|    correct position  : " << std::setw(6) << substepsPerFrame * correctPositionTime  << " ms\n"
+        << "|    band nodes        : " << std::setw(6) << bandNodes            << "\n"
+        << "|    surface memory    : " << std::setw(6) << surfaceMemory        << " MB\n"
+        << "|    dirty blocks      : " << std::setw(6) << dirtyBlocks          << "\n"
         << "|    distance field    : " << std::setw(6) << distanceFieldTime    << " ms\n"
         << "|    marching cubes    : " << std::setw(6) << marchingCubesTime    << " ms\n"
         << std::endl;
@@ -143,63 +452,274 @@ void IISPHsolver3D::showDetailedStatistics() {
 
 /*-------------------------------------------Neighbor search------------------------------------------------*/
 
-void IISPHsolver3D::buildNeighborGrid() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::buildNeighborGrid() {
+    if (_quantizedPositions) {
+        #pragma omp parallel for
+        for (int i = 0; i < _fluidCount; i++)
+            _fQuantized[i] = _pGridHelper.quantize(_fPosition[i]);
+    }
+
     for (auto& fIndices : _fGrid) {
         size_t lastFluidGridSize = fIndices.size();
         fIndices.clear();
         fIndices.reserve(lastFluidGridSize);
     }
 
-    for (auto& bIndices : _bGrid) {
-        size_t lastBoundaryGridSize = bIndices.size();
-        bIndices.clear();
-        bIndices.reserve(lastBoundaryGridSize);
-    }
-
     for (int i = 0; i < _fluidCount; i++)
         fillFluidGrid(i);
-
-    for (int i = 0; i < _boundaryCount; i++)
-        fillBoundaryGrid(i);
 }
 
-void IISPHsolver3D::searchNeighbors() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::searchNeighbors() {
+    // with adaptive resolution, a pair interacts within the sum of both smoothing lengths
+    T maxSpacing = _h * std::cbrt((T)(1 << _levelInUse));
+
 #pragma omp parallel for
     for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
         // search for fluid neighbor particles
         size_t lastFluidSize = _fNeighbors[i].size();
         _fNeighbors[i].clear();
         _fNeighbors[i].reserve(lastFluidSize);
-        findFluidNeighbors(_fNeighbors[i], _fPosition[i], 2 * _h);
+
+        if (_adaptiveResolution) {
+            findFluidNeighbors(_fNeighbors[i], _fPosition[i], _fSpacing[i] + maxSpacing);
+
+            auto outOfRange = [&](Index j) { return fluidOffset(i, j).lengthSquare() >= square(_fSpacing[i] + _fSpacing[j]); };
+            _fNeighbors[i].erase(std::remove_if(_fNeighbors[i].begin(), _fNeighbors[i].end(), outOfRange), _fNeighbors[i].end());
+        }
+        else
+            findFluidNeighbors(_fNeighbors[i], _fPosition[i], 2 * _h);
 
         // search for boundary neighbor particles
         size_t lastBoundarySize = _bNeighbors[i].size();
         _bNeighbors[i].clear();
         _bNeighbors[i].reserve(lastBoundarySize);
-        findBoundaryNeighbors(_bNeighbors[i], _fPosition[i], 2 * _h);
+        findBoundaryNeighbors(_bNeighbors[i], _fPosition[i], _adaptiveResolution ? _fSpacing[i] + _h : 2 * _h);
+
+        // static walls baked in the boundary maps, once the maps exist
+        if (_implicitBoundaries && !_mapDistance.empty())
+            sampleBoundaryMaps(i);
     }
 }
 
-void IISPHsolver3D::fillFluidGrid(int i) {
+template <class T, class A>
+void IISPHsolver3D<T, A>::fillFluidGrid(int i) {
+    if (_fState[i] != SLOT_ALIVE)
+        return;
+
     int id = _pGridHelper.cellID(_fPosition[i]);
 
     if (_pGridHelper.isInsideGrid(id))
         _fGrid[id].push_back(i);
 }
 
-void IISPHsolver3D::fillBoundaryGrid(int i) {
+template <class T, class A>
+void IISPHsolver3D<T, A>::fillBoundaryGrid(int i) {
     int id = _pGridHelper.cellID(_bPosition[i]);
 
     if (_pGridHelper.isInsideGrid(id))
         _bGrid[id].push_back(i);
 }
 
-void IISPHsolver3D::findFluidNeighbors(std::vector< Index >& neighbors, Vec3f position, const float radius) {
+template <class T, class A>
+void IISPHsolver3D<T, A>::moveBoundaries() {
+    for (auto& group : _bGroups) {
+        if (!group.isMoving())
+            continue;
+
+        // rigid motion of the group frame (Rodrigues rotation of its axes)
+        group.center += _dt * group.velocity;
+
+        T angle = group.angularVelocity.length() * _dt;
+        if (angle > 0.0f) {
+            Vec3 axis = group.angularVelocity / group.angularVelocity.length();
+            T    cosA = std::cos(angle);
+            T    sinA = std::sin(angle);
+
+            for (auto& e : group.frame)
+                e = e * cosA + axis.crossProduct(e) * sinA + axis * (axis.dotProduct(e) * (1 - cosA));
+
+            group.frame[0].normalize();
+            group.frame[1] = (group.frame[1] - group.frame[0] * group.frame[0].dotProduct(group.frame[1])).normalize();
+            group.frame[2] = group.frame[0].crossProduct(group.frame[1]);
+        }
+
+        int count = (int)group.local.size();
+
+        #pragma omp parallel for
+        for (int k = 0; k < count; k++) {
+            Index i = group.first + k;
+            Vec3  r = group.frame[0] * group.local[k].x + group.frame[1] * group.local[k].y + group.frame[2] * group.local[k].z;
+
+            _bPosition[i] = group.center + r;
+            _bVelocity[i] = group.velocity + group.angularVelocity.crossProduct(r);
+
+            if (_quantizedPositions)
+                _bQuantized[i] = _pGridHelper.quantize(_bPosition[i]);
+        }
+
+        // only samples changing cell touch the grid
+        for (int k = 0; k < count; k++) {
+            Index i    = group.first + k;
+            Index cell = _pGridHelper.cellID(_bPosition[i]);
+
+            if (cell == group.cells[k])
+                continue;
+
+            if (_pGridHelper.isInsideGrid(group.cells[k])) {
+                std::vector<Index>& oldCell = _bGrid[group.cells[k]];
+                auto it = std::find(oldCell.begin(), oldCell.end(), i);
+
+                if (it != oldCell.end()) {
+                    *it = oldCell.back();
+                    oldCell.pop_back();
+                }
+            }
+
+            if (_pGridHelper.isInsideGrid(cell))
+                _bGrid[cell].push_back(i);
+
+            group.cells[k] = cell;
+        }
+
+        // static walls keep their boundary volume, only the moved samples are updated
+        #pragma omp parallel for
+        for (int k = 0; k < count; k++)
+            computePsi(group.first + k);
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::bakeBoundaryMaps() {
+    if (_mapSpacing <= 0.0f)
+        _mapSpacing = 0.25f * _h;
+
+    // nodes at the corners of the map cells, covering the particle grid
+    _mGridHelper = GridHelper(_mapSpacing, _pGridHelper.size());
+    _mapRes      = Vec3i(_mGridHelper.resX() + 1, _mGridHelper.resY() + 1, _mGridHelper.resZ() + 1);
+    int nodeCount = _mapRes.x * _mapRes.y * _mapRes.z;
+
+    // animated groups stay particles, every other sample belongs to a static wall
+    std::vector<char> isStatic(_boundaryCount, 1);
+    for (auto& group : _bGroups)
+        std::fill(isStatic.begin() + group.first, isStatic.begin() + group.first + group.local.size(), 0);
+
+    _mapDistance = std::vector<T>    (nodeCount, 0.0f);
+    _mapVolume   = std::vector<T>    (nodeCount, 0.0f);
+    _mapGradient = std::vector<Vec3> (nodeCount, Vec3(0.0f));
+    _mapCount    = std::vector<T>    (nodeCount, 0.0f);
+
+    Vec3 upperNode = Vec3(_pGridHelper.size()) * (T)(1 - 1e-5f);
+
+#pragma omp parallel for
+    for (int n = 0; n < nodeCount; n++) {
+        int x = n % _mapRes.x;
+        int y = (n / _mapRes.x) % _mapRes.y;
+        int z = n / (_mapRes.x * _mapRes.y);
+
+        Vec3 node(x * _mapSpacing, y * _mapSpacing, z * _mapSpacing);
+        Vec3 query(std::min(node.x, upperNode.x), std::min(node.y, upperNode.y), std::min(node.z, upperNode.z));
+
+        std::vector<Index> boundaryNeighbors;
+        findBoundaryNeighbors(boundaryNeighbors, query, 2 * _h);
+
+        A     volume   = 0.0f;
+        Vec3A gradient(0.0f);
+        A     distance = 2 * _h;
+        int   count    = 0;
+        Vec3A pos_nb;
+
+        for (Index& b : boundaryNeighbors) {
+            if (!isStatic[b])
+                continue;
+
+            pos_nb    = periodicOffset(Vec3A(node - _bPosition[b]));
+            volume   += _Psi[b] * _pKernel.W(pos_nb);
+            gradient += _Psi[b] * _pKernel.gradW(pos_nb);
+            distance  = std::min(distance, pos_nb.length());
+            count++;
+        }
+
+        // walls are shells half a smoothing length thick, the distance is negative inside them
+        _mapDistance[n] = distance - 0.5f * _h;
+        _mapVolume[n]   = volume;
+        _mapGradient[n] = Vec3(gradient);
+        _mapCount[n]    = count;
+    }
+
+    // static samples leave the boundary grid, their cells are remembered as walls
+    _wallCells = std::vector<char>((size_t)_pGridHelper.cellCount(), 0);
+
+    for (size_t c = 0; c < _bGrid.size(); c++) {
+        auto isWall = [&](Index b) { return isStatic[b] != 0; };
+        auto first  = std::remove_if(_bGrid[c].begin(), _bGrid[c].end(), isWall);
+
+        _wallCells[c] = first != _bGrid[c].end();
+        _bGrid[c].erase(first, _bGrid[c].end());
+    }
+
+    std::cout << "boundary map nodes           : " << nodeCount << "\n" << std::endl;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::sampleBoundaryMaps(int i) {
+    Vec3 p = _fPosition[i] / _mapSpacing;
+
+    int x0 = clamp((int)std::floor(p.x), 0, _mapRes.x - 2);
+    int y0 = clamp((int)std::floor(p.y), 0, _mapRes.y - 2);
+    int z0 = clamp((int)std::floor(p.z), 0, _mapRes.z - 2);
+    A   fx = clamp((A)p.x - x0, (A)0, (A)1);
+    A   fy = clamp((A)p.y - y0, (A)0, (A)1);
+    A   fz = clamp((A)p.z - z0, (A)0, (A)1);
+
+    Index corner[8];
+    A     weight[8];
+    A     distance = 0.0f;
+
+    for (int c = 0; c < 8; c++) {
+        int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+
+        corner[c] = (x0 + dx) + (y0 + dy) * _mapRes.x + (z0 + dz) * _mapRes.x * _mapRes.y;
+        weight[c] = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz);
+        distance += weight[c] * _mapDistance[corner[c]];
+    }
+
+    // far from the walls, every node of the cell is out of reach
+    if (distance > 1.5f * _h + _mapSpacing) {
+        _fWallVolume[i]   = 0.0f;
+        _fWallGradient[i] = Vec3(0.0f);
+        _fWallCount[i]    = 0.0f;
+        return;
+    }
+
+    A     volume = 0.0f;
+    A     count  = 0.0f;
+    Vec3A gradient(0.0f);
+
+    for (int c = 0; c < 8; c++) {
+        volume   += weight[c] * _mapVolume[corner[c]];
+        gradient += weight[c] * Vec3A(_mapGradient[corner[c]]);
+        count    += weight[c] * _mapCount[corner[c]];
+    }
+
+    _fWallVolume[i]   = volume;
+    _fWallGradient[i] = Vec3(gradient);
+    _fWallCount[i]    = count;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::findFluidNeighbors(std::vector< Index >& neighbors, Vec3 position, const T radius) {
     std::vector<Index> neighborCells;
-    Real  squaredRadius = square(radius);
-    Real  distance = 0.0f;
+    T     squaredRadius = square(radius);
+    T     distance = 0.0f;
     Index neighborID = 0;
 
+    QuantizedPosition qPosition = _quantizedPositions ? _pGridHelper.quantize(position) : QuantizedPosition();
+
     _pGridHelper.getNeighborCells(neighborCells, position, radius);
 
     for (size_t j = 0; j < neighborCells.size(); j++) {
@@ -207,7 +727,10 @@ void IISPHsolver3D::findFluidNeighbors(std::vector< Index >& neighbors, Vec3f po
 
         for (size_t k = 0; k < fluidInCell.size(); k++) {
             neighborID = fluidInCell[k];
-            distance = (_fPosition[neighborID] - position).lengthSquare();
+            if (_quantizedPositions)
+                distance = _pGridHelper.relativePosition<T>(_fQuantized[neighborID], qPosition).lengthSquare();
+            else
+                distance = periodicOffset(_fPosition[neighborID] - position).lengthSquare();
 
             if (distance < squaredRadius) {
                 neighbors.push_back(neighborID);
@@ -216,12 +739,15 @@ void IISPHsolver3D::findFluidNeighbors(std::vector< Index >& neighbors, Vec3f po
     }
 }
 
-void IISPHsolver3D::findBoundaryNeighbors(std::vector< Index >& neighbors, Vec3f position, const float radius) {
+template <class T, class A>
+void IISPHsolver3D<T, A>::findBoundaryNeighbors(std::vector< Index >& neighbors, Vec3 position, const T radius) {
     std::vector<Index> neighborCells;
-    Real  squaredRadius = square(radius);
-    Real  distance = 0.0f;
+    T     squaredRadius = square(radius);
+    T     distance = 0.0f;
     Index neighborID = 0;
 
+    QuantizedPosition qPosition = _quantizedPositions ? _pGridHelper.quantize(position) : QuantizedPosition();
+
     _pGridHelper.getNeighborCells(neighborCells, position, radius);
 
     for (size_t j = 0; j < neighborCells.size(); j++) {
@@ -229,7 +755,10 @@ void IISPHsolver3D::findBoundaryNeighbors(std::vector< Index >& neighbors, Vec3f
 
         for (size_t k = 0; k < boundaryInCell.size(); k++) {
             neighborID = boundaryInCell[k];
-            distance = (_bPosition[neighborID] - position).lengthSquare();
+            if (_quantizedPositions)
+                distance = _pGridHelper.relativePosition<T>(_bQuantized[neighborID], qPosition).lengthSquare();
+            else
+                distance = periodicOffset(_bPosition[neighborID] - position).lengthSquare();
 
             if (distance < squaredRadius) {
                 neighbors.push_back(neighborID);
@@ -242,13 +771,18 @@ void IISPHsolver3D::findBoundaryNeighbors(std::vector< Index >& neighbors, Vec3f
 
 /*-----------------------------------------Particle simulation------------------------------------------------*/
 
-void IISPHsolver3D::predictAdvection() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::predictAdvection() {
 #pragma omp parallel for
     for (int i = 0; i < _fluidCount; i++)
-        computeDensity(i);
+        if (isActive(i))
+            computeDensity(i);
 
 #pragma omp parallel for
     for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
         computeAdvectionForces(i);
         predictVelocity(i);
         storeDii(i);
@@ -256,302 +790,2218 @@ void IISPHsolver3D::predictAdvection() {
 
 #pragma omp parallel for
     for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
         predictDensity(i);
         initPressure(i);
         storeAii(i);
     }
 }
 
-void IISPHsolver3D::pressureSolve() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::pressureSolve() {
+    static int count = 1;
     int l = 0;
-    _avgDensity = 0.0f;
 
-    while (((_avgDensity - _rho0) > _eta) || (l < 2))
-    {
-#pragma omp parallel for
-        for (int i = 0; i < _fluidCount; i++)
-            storeSumDijPj(i);
+    if (_tiledSolve)
+        buildSolverTiles();
+
+    do {
+        _error = DensityError<A>();
 
+        if (_tiledSolve)
+            solveTiles();
+
+        else {
 #pragma omp parallel for
-        for (int i = 0; i < _fluidCount; i++)
-            computePressure(i);
+            for (int i = 0; i < _fluidCount; i++)
+                if (isActive(i))
+                    storeSumDijPj(i);
+
+#pragma omp parallel
+            {
+                DensityError<A> localError;
+
+#pragma omp for
+                for (int i = 0; i < _fluidCount; i++) {
+                    if (!isActive(i))
+                        continue;
+
+                    computePressure(i);
+                    localError.add(_Dcorr[i] - _rho0);
+                }
+
+                mergeError(localError);
+            }
+        }
 
-        computeError();
         l++;
-    }
+    } while (!hasConverged(l));
+
+    _avgDensity = _rho0 + _error.average();
+    _lastIterations = l;
+    pressureIterations  = (l + (count - 1) * pressureIterations) / count;
+    compressedParticles = ((double)_error.compressed / std::max(_error.count, 1) + (count - 1) * compressedParticles) / count;
+    count++;
 }
 
-void IISPHsolver3D::integration() {
-#pragma omp parallel for
-    for (int i = 0; i < _fluidCount; i++)
-        computePressureForces(i);
+template <class T, class A>
+void IISPHsolver3D<T, A>::integration() {
+    bool divergenceFree = _solverMode == DFSPH_SOLVER;
 
+    // DFSPH already corrected the predicted velocity
+    if (!divergenceFree) {
 #pragma omp parallel for
-    for (int i = 0; i < _fluidCount; i++) {
-        updateVelocity(i);
-        updatePosition(i);
+        for (int i = 0; i < _fluidCount; i++)
+            if (isActive(i))
+                computePressureForces(i);
     }
-}
 
-void IISPHsolver3D::computePsi(int i) {
-    Real sumK = 0.0f;
-    Vec3f pos_ij;
-
-    std::vector<Index> boundaryNeighbors;
-    findBoundaryNeighbors(boundaryNeighbors, _bPosition[i], _h);
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
 
-    for (Index& j : boundaryNeighbors) {
-        pos_ij = _bPosition[i] - _bPosition[j];
-        sumK += _pKernel.W(pos_ij);
+        // the pressure force of DFSPH is the change of the predicted velocity, time levels read it
+        if (divergenceFree) {
+            _Fp[i]        = fluidMass(i) * (_Vadv[i] - _fVelocity[i]) / _dt - _Fadv[i];
+            _fVelocity[i] = _Vadv[i];
+        }
+        else
+            updateVelocity(i);
     }
 
-    _Psi[i] = _rho0 / sumK;
-}
-
-void IISPHsolver3D::computeDensity(int i) {
-    _fDensity[i] = 0.0f;
-    Vec3f pos_ij;
+    if (_implicitViscosity)
+        viscositySolve();
 
-    for (Index& j : _fNeighbors[i]) {
-        pos_ij = _fPosition[i] - _fPosition[j];
-        _fDensity[i] += _m0 * _pKernel.W(pos_ij);
+    // with local time stepping, frozen particles show their latest velocity to the levels solved after them
+    // and positions of every level drift together once the due levels are solved
+    if (_localTimeStepping) {
+#pragma omp parallel for
+        for (int i = 0; i < _fluidCount; i++)
+            if (isActive(i))
+                _Vadv[i] = _fVelocity[i];
+        return;
     }
 
-    for (Index& j : _bNeighbors[i]) {
-        pos_ij = _fPosition[i] - _bPosition[j];
-        _fDensity[i] += _Psi[j] * _pKernel.W(pos_ij);
-    }
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++)
+        if (isActive(i))
+            updatePosition(i);
 }
 
-void IISPHsolver3D::computeAdvectionForces(int i) {
-    _Fadv[i].x = 0.0f;
-    _Fadv[i].y = 0.0f;
-    _Fadv[i].z = 0.0f;
-    addBodyForce(i);
-    addViscousForce(i);
-}
+template <class T, class A>
+void IISPHsolver3D<T, A>::computeTimeStep(T remainingTime) {
+    // time levels were given for the step of the current cycle, it is only adjusted to end the frame
+    if (_localTimeStepping && _localStep != 0) {
+        _dt = remainingTime / std::max((int)std::ceil(remainingTime / _dt), 1);
+        return;
+    }
 
-void IISPHsolver3D::addBodyForce(int i) {
-    _Fadv[i] += _m0 * _g;
-}
+    // let the step grow back when the pressure solve converges easily
+    if (_lastIterations > _iterationBudget)
+        _dtScale = std::max((T)0.8f * _dtScale, (T)0.1f);
+    else if (2 * _lastIterations < _iterationBudget)
+        _dtScale = std::min((T)1.1f * _dtScale, (T)1.0f);
 
-void IISPHsolver3D::addViscousForce(int i) {
-    Vec3f pos_ij;
-    Vec3f vel_ij;
+    T vmax = maxVelocity();
+    _dtCFL = vmax > std::numeric_limits<T>::epsilon() ? _cfl * _h / vmax : _dtMax;
 
-    for (Index& j : _fNeighbors[i])
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-            vel_ij = _fVelocity[i] - _fVelocity[j];
-            _Fadv[i] += 2 * _nu * (square(_m0) / _fDensity[j]) * vel_ij.dotProduct(pos_ij) * _pKernel.gradW(pos_ij) / (pos_ij.lengthSquare() + 0.01 * square(_h));
-        }
-}
+    T dt = clamp(_dtScale * _dtCFL, _dtMin, _dtMax);
 
-void IISPHsolver3D::predictVelocity(int i) {
-    _Vadv[i] = _fVelocity[i] + _dt * _Fadv[i] / _m0;
+    // split the remaining time in equal substeps
+    int substeps = std::max((int)std::ceil(remainingTime / dt), 1);
+    _dt = remainingTime / substeps;
 }
 
-void IISPHsolver3D::storeDii(int i) {
-    _Dii[i].x = 0.0f;
-    _Dii[i].y = 0.0f;
-    _Dii[i].z = 0.0f;
-    Vec3f pos_ij;
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateTimeLevels() {
+    static int count = 1;
 
-    for (Index& j : _fNeighbors[i])
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-            _Dii[i] += (-_m0 / square(_fDensity[i])) * _pKernel.gradW(pos_ij);
-        }
+    // levels are given at the start of each cycle, the window of every level then ends with it
+    if (_localStep == 0) {
+        int cellCount = (int)_fGrid.size();
+        std::vector<T> cellSpeed(cellCount, 0.0f);
+        std::vector<T> cellAcceleration(cellCount, 0.0f);
 
-    for (Index& j : _bNeighbors[i])
-        if (_bPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _bPosition[j];
-            _Dii[i] += (-_Psi[j] / square(_fDensity[i])) * _pKernel.gradW(pos_ij);
-        }
+#pragma omp parallel for
+        for (int c = 0; c < cellCount; c++)
+            for (Index i : _fGrid[c]) {
+                cellSpeed[c]        = std::max(cellSpeed[c], _fVelocity[i].lengthSquare());
+                cellAcceleration[c] = std::max(cellAcceleration[c], (_Fp[i] / fluidMass(i) + _g).lengthSquare());
+            }
 
-    _Dii[i] *= square(_dt);
-}
+        for (auto& group : _bGroups)
+            if (group.isMoving())
+                for (size_t k = 0; k < group.cells.size(); k++)
+                    if (_pGridHelper.isInsideGrid(group.cells[k]))
+                        cellSpeed[group.cells[k]] = std::max(cellSpeed[group.cells[k]], _bVelocity[group.first + k].lengthSquare());
 
-void IISPHsolver3D::predictDensity(int i) {
-    _Dadv[i] = 0.0f;
-    Vec3f pos_ij;
-    Vec3f vel_adv_ij;
+        // level k steps 2^k times further, within the largest step allowed and with a displacement under the local CFL limit
+#pragma omp parallel for
+        for (int c = 0; c < cellCount; c++) {
+            T speed        = std::sqrt(cellSpeed[c]);
+            T acceleration = std::max(std::sqrt(cellAcceleration[c]), _g.length());
+            int level = 0;
 
-    for (Index& j : _fNeighbors[i])
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-            vel_adv_ij = _Vadv[i] - _Vadv[j];
-            _Dadv[i] += _m0 * vel_adv_ij.dotProduct(_pKernel.gradW(pos_ij));
-        }
+            for (T step = 2 * _dt; level < _maxTimeLevel && step <= _dtMax && step * (speed + acceleration * step) <= _cfl * _h; step *= 2)
+                level++;
 
-    for (Index& j : _bNeighbors[i])
-        if (_bPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _bPosition[j];
-            vel_adv_ij = _Vadv[i];
-            _Dadv[i] += _Psi[j] * vel_adv_ij.dotProduct(_pKernel.gradW(pos_ij));
+            _cellTimeLevel[c] = level;
         }
 
-    _Dadv[i] *= _dt;
-    _Dadv[i] += _fDensity[i];
-}
-
-void IISPHsolver3D::initPressure(int i) {
-    _Pl[i] = 0.5f * _fPressure[i];
-}
+        // neighbor cells differ by one level at most, fast particles reach calm cells already refined
+        int resX = _pGridHelper.resX();
+        int resY = _pGridHelper.resY();
+        int resZ = _pGridHelper.resZ();
 
-void IISPHsolver3D::storeAii(int i) {
-    _Aii[i] = 0.0f;
-    Vec3f pos_ij;
-    Vec3f d_ji;
+        for (int pass = 0; pass < _maxTimeLevel; pass++) {
+            std::vector<char> previous = _cellTimeLevel;
 
-    for (Index& j : _fNeighbors[i])
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-            d_ji = -(square(_dt) * _m0 / square(_fDensity[i])) * (-_pKernel.gradW(pos_ij));
-            _Aii[i] += _m0 * (_Dii[i] - d_ji).dotProduct(_pKernel.gradW(pos_ij));
+#pragma omp parallel for
+            for (int k = 0; k < resZ; k++)
+                for (int j = 0; j < resY; j++)
+                    for (int i = 0; i < resX; i++) {
+                        char level = previous[_pGridHelper.cellID(i, j, k)];
+
+                        _pGridHelper.anyAdjacentCell(i, j, k, [&](Index c) {
+                            level = std::min(level, (char)(previous[c] + 1));
+                            return false;
+                        });
+
+                        _cellTimeLevel[_pGridHelper.cellID(i, j, k)] = level;
+                    }
         }
 
-    for (Index& j : _bNeighbors[i])
-        if (_bPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _bPosition[j];
-            _Aii[i] += _Psi[j] * _Dii[i].dotProduct(_pKernel.gradW(pos_ij));
-        }
-}
+#pragma omp parallel for
+        for (int c = 0; c < cellCount; c++)
+            for (Index i : _fGrid[c])
+                _fTimeLevel[i] = _cellTimeLevel[c];
+    }
 
-void IISPHsolver3D::storeSumDijPj(int i) {
-    _sumDijPj[i].x = 0.0f;
-    _sumDijPj[i].y = 0.0f;
-    _sumDijPj[i].z = 0.0f;
-    Vec3f pos_ij;
+    // particles due in this substep
+    std::fill(_levelCount.begin(), _levelCount.end(), 0);
+    int steppedCount = 0;
 
-    for (Index& j : _fNeighbors[i])
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-            _sumDijPj[i] += -(_m0 * _fPressure[j] / square(_fDensity[j])) * _pKernel.gradW(pos_ij);
+    for (int i = 0; i < _fluidCount; i++)
+        if (isActive(i)) {
+            _levelCount[_fTimeLevel[i]]++;
+            steppedCount++;
         }
 
-    _sumDijPj[i] *= square(_dt);
+    steppedParticles = ((T)steppedCount / std::max(_aliveCount, 1) + (count - 1) * steppedParticles) / count;
+    count++;
 }
 
-void IISPHsolver3D::computePressure(int i) {
-    _Dcorr[i] = 0.0f;
-    Vec3f pos_ij;
-    Vec3f d_ji;
-    Vec3f temp;
+template <class T, class A>
+T IISPHsolver3D<T, A>::maxVelocity() {
+    T vmax = 0.0f;
 
-    for (Index& j : _fNeighbors[i])
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-            d_ji   = -(square(_dt) * _m0 / square(_fDensity[i])) * (-_pKernel.gradW(pos_ij));
-            temp   = _sumDijPj[i] - _Dii[j] * _Pl[j] - (_sumDijPj[j] - d_ji * _Pl[i]);
-            _Dcorr[i] += _m0 * temp.dotProduct(_pKernel.gradW(pos_ij));
-        }
+#pragma omp parallel
+    {
+        T localMax = 0.0f;
 
-    for (Index& j : _bNeighbors[i])
-        if (_bPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _bPosition[j];
-            _Dcorr[i] += _Psi[j] * _sumDijPj[i].dotProduct(_pKernel.gradW(pos_ij));
-        }
+#pragma omp for
+        for (int i = 0; i < _fluidCount; i++)
+            localMax = std::max(localMax, _fVelocity[i].lengthSquare());
 
-    _Dcorr[i] += _Dadv[i];
+#pragma omp critical
+        vmax = std::max(vmax, localMax);
+    }
 
-    Real previousPl = _Pl[i];
-    if (std::abs(_Aii[i]) > std::numeric_limits<Real>::epsilon())
-        _Pl[i] = (1 - _omega) * previousPl + (_omega / _Aii[i]) * (_rho0 - _Dcorr[i]);
-    else
-        _Pl[i] = 0.0;
+    return std::sqrt(vmax);
+}
 
-    _fPressure[i] = std::fmax(_Pl[i], 0.0f);
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateSleeping() {
+    static int count = 1;
+    T squaredVelocity = square(_sleepVelocity);
+    T maxError        = _sleepDensity * _rho0;
+    T wakeVelocity    = 25 * squaredVelocity;   // hysteresis : only particles 5 times faster wake their neighbors
+
+    // count steps spent at rest
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
+        bool atRest = _fVelocity[i].lengthSquare() < squaredVelocity && std::abs(_fDensity[i] - _rho0) < maxError;
+        _fRestSteps[i] = atRest ? std::min(_fRestSteps[i] + 1, _sleepSteps) : 0;
+    }
+
+    // cells holding a moving particle
+#pragma omp parallel for
+    for (int c = 0; c < (int)_fGrid.size(); c++) {
+        _activeCells[c] = 0;
+
+        for (Index i : _fGrid[c])
+            if (isActive(i) && _fVelocity[i].lengthSquare() > wakeVelocity) {
+                _activeCells[c] = 1;
+                break;
+            }
+    }
+
+    // moving boundaries disturb their cells too
+    for (auto& group : _bGroups)
+        if (group.isMoving())
+            for (Index c : group.cells)
+                if (_pGridHelper.isInsideGrid(c))
+                    _activeCells[c] = 1;
+
+    // moving particles wake the sleeping ones of their neighbor cells
+    int resX = _pGridHelper.resX();
+    int resY = _pGridHelper.resY();
+    int resZ = _pGridHelper.resZ();
+
+#pragma omp parallel for
+    for (int k = 0; k < resZ; k++)
+        for (int j = 0; j < resY; j++)
+            for (int i = 0; i < resX; i++) {
+                bool disturbed = _pGridHelper.anyAdjacentCell(i, j, k, [&](Index c) { return _activeCells[c] != 0; });
+
+                if (!disturbed)
+                    continue;
+
+                for (Index p : _fGrid[_pGridHelper.cellID(i, j, k)])
+                    if (_fSleeping[p]) {
+                        _fSleeping[p]  = 0;
+                        _fRestSteps[p] = 0;
+                    }
+            }
+
+    // particles at rest long enough, surrounded by particles at rest, fall asleep
+    int sleepingCount = 0;
+
+#pragma omp parallel for reduction(+:sleepingCount)
+    for (int i = 0; i < _fluidCount; i++) {
+        if (_fSleeping[i]) {
+            sleepingCount++;
+            continue;
+        }
+
+        if (_fRestSteps[i] < _sleepSteps)
+            continue;
+
+        bool neighborsAtRest = true;
+        for (Index& j : _fNeighbors[i])
+            if (_fRestSteps[j] < _sleepSteps) {
+                neighborsAtRest = false;
+                break;
+            }
+
+        if (neighborsAtRest) {
+            _fSleeping[i] = 1;
+            _fVelocity[i] = Vec3(0.0f);
+            _Vadv[i]      = Vec3(0.0f);
+
+            // DFSPH stiffness only applies to the iteration it was computed in
+            if (_solverMode == DFSPH_SOLVER)
+                _Pl[i] = 0.0f;
+            sleepingCount++;
+        }
+    }
+
+    sleepingParticles = ((T)sleepingCount / std::max(_aliveCount, 1) + (count - 1) * sleepingParticles) / count;
+    count++;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateResolution() {
+    static int count = 1;
+    int mergedCount = 0;
+    int splitCount  = 0;
+
+    computeCellDepth();
+
+    // a level is allowed from _fineDepth + level cells under the surface, merging waits for one more cell
+    auto allowedLevel = [&](int depth) { return clamp(depth - _fineDepth, 0, _maxLevel); };
+
+    // heavy particles reaching the surface split back, until the pool is full
+    int fluidCount = _fluidCount;
+    for (int i = 0; i < fluidCount; i++) {
+        if (!isActive(i) || _fLevel[i] == 0)
+            continue;
+
+        if (_fLevel[i] > allowedLevel(_cellDepth[_pGridHelper.cellID(_fPosition[i])])) {
+            if (!splitParticle(i, _splitAxis))
+                break;
+            splitCount++;
+        }
+    }
+
+    // deep particles merge with their closest neighbor of the same level in their cell
+    std::vector<char> merged(_fluidCount, 0);
+
+    for (int c = 0; c < (int)_fGrid.size(); c++) {
+        int maxLevel = allowedLevel(_cellDepth[c] - 1);
+        if (maxLevel == 0)
+            continue;
+
+        std::vector<Index>& cell = _fGrid[c];
+
+        for (size_t a = 0; a < cell.size(); a++) {
+            Index i = cell[a];
+            if (!isActive(i) || merged[i] || _fLevel[i] >= maxLevel)
+                continue;
+
+            // resting particles are about one spacing apart
+            int closest = -1;
+            T   closestDistance = square(1.5f * _fSpacing[i]);
+
+            for (size_t b = a + 1; b < cell.size(); b++) {
+                Index j = cell[b];
+                if (!isActive(j) || merged[j] || _fLevel[j] != _fLevel[i])
+                    continue;
+
+                T distance = (_fPosition[i] - _fPosition[j]).lengthSquare();
+                if (distance < closestDistance) {
+                    closest = j;
+                    closestDistance = distance;
+                }
+            }
+
+            if (closest < 0)
+                continue;
+
+            mergeParticles(i, closest);
+            merged[i] = merged[closest] = 1;
+            mergedCount++;
+        }
+    }
+
+    // alternate split axes to avoid stacking children along one direction
+    _splitAxis = (_splitAxis + 1) % 3;
+
+    // heaviest level left, bounds the neighbor search radius
+    int previousLevel = _levelInUse;
+    _levelInUse = 0;
+    for (int i = 0; i < _fluidCount; i++)
+        if (_fState[i] == SLOT_ALIVE)
+            _levelInUse = std::max(_levelInUse, (int)_fLevel[i]);
+
+    // the radius sets the smallest tile
+    if (_levelInUse != previousLevel)
+        prepareSolverTiles();
+
+    mergedParticles = (mergedCount + (count - 1) * mergedParticles) / count;
+    splitParticles  = (splitCount  + (count - 1) * splitParticles)  / count;
+    count++;
+}
+
+template <class T, class A>
+bool IISPHsolver3D<T, A>::isSurfaceParticle(int i) {
+    if (neighborCount(i) < 20)
+        return true;
+
+    // color field gradient, walls count as filled space
+    Vec3A normal(0.0f);
+    Vec3A pos_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij  = fluidOffset(i, j);
+            normal += (fluidMass(j) / _fDensity[j]) * fluidGradW(i, j, pos_ij);
+        }
+
+    for (Index& j : _bNeighbors[i])
+        if (!boundaryOverlap(i, j)) {
+            pos_ij  = boundaryOffset(i, j);
+            normal += (_Psi[j] / _rho0) * boundaryGradW(i, pos_ij);
+        }
+
+    normal += wallGradient(i) / _rho0;
+
+    // about 0.7 / h at a flat free surface
+    return normal.length() * _fSpacing[i] > 0.35f;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::computeCellDepth() {
+    int  resX     = _pGridHelper.resX();
+    int  resY     = _pGridHelper.resY();
+    int  resZ     = _pGridHelper.resZ();
+    char maxDepth = (char)std::min(_fineDepth + _maxLevel + 1, 127);
+
+    // air, walls and cells holding a surface particle are at depth 0, boundary volumes assume the rest spacing
+#pragma omp parallel for
+    for (int c = 0; c < (int)_fGrid.size(); c++) {
+        bool surface = _fGrid[c].empty() || !_bGrid[c].empty() || (_implicitBoundaries && _wallCells[c]);
+
+        for (size_t k = 0; k < _fGrid[c].size() && !surface; k++)
+            surface = isActive(_fGrid[c][k]) && isSurfaceParticle(_fGrid[c][k]);
+
+        _cellDepth[c] = surface ? 0 : maxDepth;
+    }
+
+    // chessboard distance grown one layer at a time
+    for (char d = 1; d < maxDepth; d++) {
+#pragma omp parallel for
+        for (int k = 0; k < resZ; k++)
+            for (int j = 0; j < resY; j++)
+                for (int i = 0; i < resX; i++) {
+                    Index c = _pGridHelper.cellID(i, j, k);
+                    if (_cellDepth[c] != maxDepth)
+                        continue;
+
+                    bool reached = _pGridHelper.anyAdjacentCell(i, j, k, [&](Index n) { return _cellDepth[n] == d - 1; });
+
+                    if (reached)
+                        _cellDepth[c] = d;
+                }
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::calibratePsi() {
+    // flat wall at the default spacing, Psi of its center sample from both supports
+    T spacing = 0.5f * _pGridHelper.cellSize();
+    A sumNear = 0.0f;
+    A sumFull = 0.0f;
+    int reach = (int)std::ceil(2 * _h / spacing);
+
+    for (int a = -reach; a <= reach; a++)
+        for (int b = -reach; b <= reach; b++) {
+            Vec3A pos_ij((A)(a * spacing), (A)0, (A)(b * spacing));
+            A     W = _pKernel.W(pos_ij);
+
+            sumFull += W;
+            if (pos_ij.lengthSquare() < square(_h))
+                sumNear += W;
+        }
+
+    _psiCalibration = sumFull / sumNear;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::computePsi(int i) {
+    A sumK = 0.0f;
+    Vec3A pos_ij;
+
+    // coarse walls sum over the whole support : the volume then grows with the area of a sample
+    std::vector<Index> boundaryNeighbors;
+    findBoundaryNeighbors(boundaryNeighbors, _bPosition[i], _boundarySpacing > 0.0f ? 2 * _h : _h);
+
+    for (Index& j : boundaryNeighbors) {
+        pos_ij = periodicOffset(Vec3A(_bPosition[i] - _bPosition[j]));
+        sumK += _pKernel.W(pos_ij);
+    }
+
+    _Psi[i] = _psiCalibration * _rho0 / sumK;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::computeDensity(int i) {
+    A density = 0.0f;
+    Vec3A pos_ij;
+
+    for (Index& j : _fNeighbors[i]) {
+        pos_ij = fluidOffset(i, j);
+        density += fluidMass(j) * fluidW(i, j, pos_ij);
+    }
+
+    for (Index& j : _bNeighbors[i]) {
+        pos_ij = boundaryOffset(i, j);
+        density += _Psi[j] * boundaryW(i, pos_ij);
+    }
+
+    density += wallVolume(i);
+
+    // particles disturbed by a merge or a split keep their previous density, the shift then fades out
+    if (_adaptiveResolution) {
+        if (_fRebalance[i]) {
+            _fDensityShift[i] = density - _fDensity[i];
+            _fRebalance[i] = 0;
+        }
+
+        density -= _fDensityShift[i];
+        _fDensityShift[i] *= _blendDecay;
+    }
+
+    _fDensity[i] = density;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::computeAdvectionForces(int i) {
+    _Fadv[i].x = 0.0f;
+    _Fadv[i].y = 0.0f;
+    _Fadv[i].z = 0.0f;
+    addBodyForce(i);
+
+    if (!_implicitViscosity)
+        addViscousForce(i);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::addBodyForce(int i) {
+    _Fadv[i] += fluidMass(i) * _g;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::addViscousForce(int i) {
+    Vec3A force = Vec3A(_Fadv[i]);
+    Vec3A pos_ij;
+    Vec3A vel_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            vel_ij = Vec3A(_fVelocity[i] - _fVelocity[j]);
+            force += 2 * _nu * (fluidMass(i) * fluidMass(j) / _fDensity[j]) * vel_ij.dotProduct(pos_ij) * fluidGradW(i, j, pos_ij) / (pos_ij.lengthSquare() + 0.01 * square(_h));
+        }
+
+    _Fadv[i] = Vec3(force);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::predictVelocity(int i) {
+    _Vadv[i] = _fVelocity[i] + _dt * _Fadv[i] / fluidMass(i);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::storeDii(int i) {
+    Vec3A dii(0.0f);
+    Vec3A pos_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            dii += (-fluidMass(j) / square(_fDensity[i])) * fluidGradW(i, j, pos_ij);
+        }
+
+    for (Index& j : _bNeighbors[i])
+        if (!boundaryOverlap(i, j)) {
+            pos_ij = boundaryOffset(i, j);
+            dii += (-_Psi[j] / square(_fDensity[i])) * boundaryGradW(i, pos_ij);
+        }
+
+    dii += (-1 / square(_fDensity[i])) * wallGradient(i);
+
+    dii *= square(_dt);
+    _Dii[i] = Vec3(dii);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::predictDensity(int i) {
+    A dadv = 0.0f;
+    Vec3A pos_ij;
+    Vec3A vel_adv_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            vel_adv_ij = Vec3A(_Vadv[i] - _Vadv[j]);
+            dadv += fluidMass(j) * vel_adv_ij.dotProduct(fluidGradW(i, j, pos_ij));
+        }
+
+    for (Index& j : _bNeighbors[i])
+        if (!boundaryOverlap(i, j)) {
+            pos_ij = boundaryOffset(i, j);
+            vel_adv_ij = Vec3A(_Vadv[i] - _bVelocity[j]);
+            dadv += _Psi[j] * vel_adv_ij.dotProduct(boundaryGradW(i, pos_ij));
+        }
+
+    dadv += Vec3A(_Vadv[i]).dotProduct(wallGradient(i));
+
+    dadv *= _dt;
+    dadv += _fDensity[i];
+    _Dadv[i] = dadv;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::initPressure(int i) {
+    _Pl[i] = 0.5f * _fPressure[i];
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::storeAii(int i) {
+    A aii = 0.0f;
+    Vec3A pos_ij;
+    Vec3A d_ji;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+
+            // frozen neighbors are not displaced by the pressure of i
+            if (isFrozen(j))
+                d_ji = Vec3A(0.0f);
+            else
+                d_ji = -(square(_dt) * fluidMass(i) / square(_fDensity[i])) * (-fluidGradW(i, j, pos_ij));
+
+            aii += fluidMass(j) * (Vec3A(_Dii[i]) - d_ji).dotProduct(fluidGradW(i, j, pos_ij));
+        }
+
+    for (Index& j : _bNeighbors[i])
+        if (!boundaryOverlap(i, j)) {
+            pos_ij = boundaryOffset(i, j);
+            aii += _Psi[j] * Vec3A(_Dii[i]).dotProduct(boundaryGradW(i, pos_ij));
+        }
+
+    aii += Vec3A(_Dii[i]).dotProduct(wallGradient(i));
+
+    _Aii[i] = aii;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::storeSumDijPj(int i) {
+    Vec3A sumDijPj(0.0f);
+    Vec3A pos_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            sumDijPj += -(fluidMass(j) * frozenPressure(i, j) / square(_fDensity[j])) * fluidGradW(i, j, pos_ij);
+        }
+
+    sumDijPj *= square(_dt);
+    _sumDijPj[i] = Vec3(sumDijPj);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::computePressure(int i) {
+    A dcorr = 0.0f;
+    Vec3A pos_ij;
+    Vec3A d_ji;
+    Vec3A temp;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+
+            // frozen neighbors are not displaced by the pressure solve, like boundaries
+            if (isFrozen(j))
+                temp = Vec3A(_sumDijPj[i]);
+            else {
+                d_ji = -(square(_dt) * fluidMass(i) / square(_fDensity[i])) * (-fluidGradW(i, j, pos_ij));
+                temp = Vec3A(_sumDijPj[i]) - Vec3A(_Dii[j]) * _Pl[j] - (Vec3A(_sumDijPj[j]) - d_ji * _Pl[i]);
+            }
+
+            dcorr += fluidMass(j) * temp.dotProduct(fluidGradW(i, j, pos_ij));
+        }
+
+    for (Index& j : _bNeighbors[i])
+        if (!boundaryOverlap(i, j)) {
+            pos_ij = boundaryOffset(i, j);
+            dcorr += _Psi[j] * Vec3A(_sumDijPj[i]).dotProduct(boundaryGradW(i, pos_ij));
+        }
+
+    dcorr += Vec3A(_sumDijPj[i]).dotProduct(wallGradient(i));
+
+    dcorr += _Dadv[i];
+
+    T previousPl = _Pl[i];
+    if (std::abs(_Aii[i]) > std::numeric_limits<T>::epsilon())
+        _Pl[i] = (1 - _omega) * previousPl + (_omega / _Aii[i]) * (_rho0 - dcorr);
+    else
+        _Pl[i] = 0.0;
+
+    _fPressure[i] = std::fmax(_Pl[i], 0.0f);
     _Pl[i] = _fPressure[i];
-    _Dcorr[i] += _Aii[i] * previousPl;
+    _Dcorr[i] = dcorr + _Aii[i] * previousPl;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::mergeError(const DensityError<A>& error) {
+#pragma omp critical
+    _error.merge(error);
+}
+
+template <class T, class A>
+bool IISPHsolver3D<T, A>::hasConverged(int l) {
+    if (l < _minIterations)
+        return false;
+
+    if (l >= _maxIterations)
+        return true;
+
+    switch (_toleranceMode) {
+    case MAX_ERROR:
+        return _error.max <= _maxEta;
+    case AVERAGE_AND_MAX_ERROR:
+        return _error.average() <= _eta && _error.max <= _maxEta;
+    default:
+        return _error.average() <= _eta;
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::predictAdvectionDF() {
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
+        computeDensity(i);
+        computeFactor(i);
+        _Vadv[i] = _fVelocity[i];
+    }
+
+    // velocities of the previous step made divergence-free on the new positions
+    divergenceSolve();
+
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
+        _fVelocity[i] = _Vadv[i];
+        computeAdvectionForces(i);
+        predictVelocity(i);
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::divergenceSolve() {
+    static int count = 1;
+    int l = 0;
+
+    // warm start with half the stiffness of the previous step, then accumulate this step only
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++)
+        if (isActive(i))
+            _Pl[i] = 0.5f * _kappaV[i] / _dt;
+
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
+        correctVelocity(i);
+        _kappaV[i] = 0.0f;
+    }
+
+    do {
+        _error = DensityError<A>();
+
+#pragma omp parallel
+        {
+            DensityError<A> localError;
+
+#pragma omp for
+            for (int i = 0; i < _fluidCount; i++) {
+                if (!isActive(i))
+                    continue;
+
+                // only compressing flows are corrected, particles lacking neighbors would get huge factors
+                A densityChange = 0.0f;
+                if (neighborCount(i) >= 20) {
+                    predictDensity(i);
+                    densityChange = _Dadv[i] - _fDensity[i];
+                }
+
+                _Pl[i]      = std::max(densityChange, (A)0) / square(_dt) * _Aii[i];
+                _kappaV[i] += _Pl[i] * _dt;
+                localError.add(densityChange);
+            }
+
+            mergeError(localError);
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < _fluidCount; i++)
+            if (isActive(i))
+                correctVelocity(i);
+
+        l++;
+    } while (!hasConverged(l));
+
+    divergenceIterations = (l + (count - 1) * divergenceIterations) / count;
+    count++;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::densitySolve() {
+    static int count = 1;
+    int l = 0;
+
+    // warm start with the stiffness of the previous step, then accumulate this step only
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++)
+        if (isActive(i))
+            _Pl[i] = _kappa[i] / square(_dt);
+
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
+        correctVelocity(i);
+        _kappa[i] = 0.0f;
+    }
+
+    do {
+        _error = DensityError<A>();
+
+#pragma omp parallel
+        {
+            DensityError<A> localError;
+
+#pragma omp for
+            for (int i = 0; i < _fluidCount; i++) {
+                if (!isActive(i))
+                    continue;
+
+                // only compression is corrected
+                predictDensity(i);
+                A densityError = _Dadv[i] - _rho0;
+
+                _Pl[i]     = std::max(densityError, (A)0) / square(_dt) * _Aii[i];
+                _kappa[i] += _Pl[i] * square(_dt);
+                localError.add(densityError);
+            }
+
+            mergeError(localError);
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < _fluidCount; i++)
+            if (isActive(i))
+                correctVelocity(i);
+
+        l++;
+    } while (!hasConverged(l));
+
+    // equivalent pressure, kappa plays the role of p / rho^2
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++)
+        if (isActive(i))
+            _fPressure[i] = _kappa[i] / square(_dt) * square(_fDensity[i]);
+
+    _avgDensity = _rho0 + _error.average();
+    _lastIterations = l;
+    pressureIterations  = (l + (count - 1) * pressureIterations) / count;
+    compressedParticles = ((double)_error.compressed / std::max(_error.count, 1) + (count - 1) * compressedParticles) / count;
+    count++;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::computeFactor(int i) {
+    Vec3A sumGrad(0.0f);
+    A     sumSquaredGrad = 0.0f;
+    Vec3A pos_ij;
+    Vec3A grad;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            grad   = fluidMass(j) * fluidGradW(i, j, pos_ij);
+            sumGrad        += grad;
+            sumSquaredGrad += grad.lengthSquare();
+        }
+
+    for (Index& j : _bNeighbors[i])
+        if (!boundaryOverlap(i, j)) {
+            pos_ij = boundaryOffset(i, j);
+            sumGrad += _Psi[j] * boundaryGradW(i, pos_ij);
+        }
+
+    sumGrad += wallGradient(i);
+
+    A denominator = sumGrad.lengthSquare() + sumSquaredGrad;
+    _Aii[i] = denominator > std::numeric_limits<T>::epsilon() ? 1 / denominator : 0.0f;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::correctVelocity(int i) {
+    Vec3A dv(0.0f);
+    Vec3A pos_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            dv += fluidMass(j) * (_Pl[i] + _Pl[j]) * fluidGradW(i, j, pos_ij);
+        }
+
+    for (Index& j : _bNeighbors[i])
+        if (!boundaryOverlap(i, j)) {
+            pos_ij = boundaryOffset(i, j);
+            dv += _Psi[j] * _Pl[i] * boundaryGradW(i, pos_ij);
+        }
+
+    dv += _Pl[i] * wallGradient(i);
+
+    _Vadv[i] = Vec3(Vec3A(_Vadv[i]) - _dt * dv);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::viscositySolve() {
+    static int count = 1;
+    int l = 0;
+    A rz = 0.0f;    // residual dot preconditioned residual
+    A rr = 0.0f;    // squared norm of the residual
+    A bb = 0.0f;    // squared norm of the right-hand side
+
+    // keep the pressure-corrected velocity in _Vadv, start from it plus the viscous change of the last step
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++) {
+        _viscDirection[i] = Vec3(0.0f);
+
+        if (!isActive(i))
+            continue;
+
+        _Vadv[i]       = _fVelocity[i];
+        _fVelocity[i] += _Vvisc[i];
+        storeViscosityDiagonal(i);
+    }
+
+    // inactive neighbors keep their velocity and a null search direction
+#pragma omp parallel for reduction(+:rz, rr, bb)
+    for (int i = 0; i < _fluidCount; i++) {
+        if (!isActive(i))
+            continue;
+
+        Vec3A b = (fluidMass(i) / _fDensity[i]) * Vec3A(_Vadv[i]);
+        Vec3A r = b - multiplyViscosity(i, _fVelocity);
+        Vec3A z = r / Vec3A(_viscDiagonal[i]);
+
+        _viscResidual[i]  = Vec3(r);
+        _viscDirection[i] = Vec3(z);
+        rz += r.dotProduct(z);
+        rr += r.lengthSquare();
+        bb += b.lengthSquare();
+    }
+
+    while (l < _maxViscosityIterations && rr > square(_viscosityTolerance) * bb) {
+        A pAp = 0.0f;
+
+#pragma omp parallel for reduction(+:pAp)
+        for (int i = 0; i < _fluidCount; i++) {
+            if (!isActive(i))
+                continue;
+
+            Vec3A product = multiplyViscosity(i, _viscDirection);
+            _viscProduct[i] = Vec3(product);
+            pAp += product.dotProduct(Vec3A(_viscDirection[i]));
+        }
+
+        if (pAp <= std::numeric_limits<A>::min())
+            break;
+
+        A alpha = rz / pAp;
+        A rzNew = 0.0f;
+        rr = 0.0f;
+
+#pragma omp parallel for reduction(+:rzNew, rr)
+        for (int i = 0; i < _fluidCount; i++) {
+            if (!isActive(i))
+                continue;
+
+            Vec3A r = Vec3A(_viscResidual[i]) - alpha * Vec3A(_viscProduct[i]);
+            _fVelocity[i]   += Vec3(alpha * Vec3A(_viscDirection[i]));
+            _viscResidual[i] = Vec3(r);
+            rzNew += r.dotProduct(r / Vec3A(_viscDiagonal[i]));
+            rr    += r.lengthSquare();
+        }
+
+        A beta = rzNew / rz;
+        rz = rzNew;
+
+#pragma omp parallel for
+        for (int i = 0; i < _fluidCount; i++)
+            if (isActive(i))
+                _viscDirection[i] = Vec3(Vec3A(_viscResidual[i]) / Vec3A(_viscDiagonal[i]) + beta * Vec3A(_viscDirection[i]));
+
+        l++;
+    }
+
+#pragma omp parallel for
+    for (int i = 0; i < _fluidCount; i++)
+        if (isActive(i))
+            _Vvisc[i] = _fVelocity[i] - _Vadv[i];
+
+    viscosityIterations = (l + (count - 1) * viscosityIterations) / count;
+    count++;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::storeViscosityDiagonal(int i) {
+    Vec3A diagonal(fluidMass(i) / _fDensity[i]);
+    Vec3A pos_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            A coeff = 2 * _nu * fluidMass(i) * fluidMass(j) / (_fDensity[i] * _fDensity[j]) / (pos_ij.lengthSquare() + 0.01 * square(_h));
+            diagonal -= _dt * coeff * (pos_ij * fluidGradW(i, j, pos_ij));
+        }
+
+    _viscDiagonal[i] = Vec3(diagonal);
+}
+
+template <class T, class A>
+typename IISPHsolver3D<T, A>::Vec3A IISPHsolver3D<T, A>::multiplyViscosity(int i, const std::vector<Vec3>& x) {
+    // volume-weighted rows keep the system symmetric, the Laplacian is the one of addViscousForce
+    Vec3A product = (fluidMass(i) / _fDensity[i]) * Vec3A(x[i]);
+    Vec3A pos_ij;
+    Vec3A vel_ij;
+
+    for (Index& j : _fNeighbors[i])
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            vel_ij = Vec3A(x[i] - x[j]);
+            A coeff = 2 * _nu * fluidMass(i) * fluidMass(j) / (_fDensity[i] * _fDensity[j]) / (pos_ij.lengthSquare() + 0.01 * square(_h));
+            product -= _dt * coeff * vel_ij.dotProduct(pos_ij) * fluidGradW(i, j, pos_ij);
+        }
+
+    return product;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::prepareSolverTiles() {
+    // estimate the bytes streamed per particle during one Jacobi sweep
+    Index neighborCount = 0;
+    for (int i = 0; i < _fluidCount; i++)
+        neighborCount += _fNeighbors[i].size() + _bNeighbors[i].size();
+
+    int occupiedCells = 0;
+    for (auto& fIndices : _fGrid)
+        occupiedCells += fIndices.empty() ? 0 : 1;
+
+    T avgNeighbors    = _fluidCount > 0 ? (T)neighborCount / _fluidCount : 0.0f;
+    T particlesInCell = occupiedCells > 0 ? (T)_fluidCount / occupiedCells : 1.0f;
+    T particleBytes   = 3 * sizeof(Vec3) + 6 * sizeof(T) + 2 * sizeof(std::vector<Index>) + avgNeighbors * sizeof(Index);
+
+    // largest tile which fits in cache along with its one-cell halo
+    T cellsInCache = _cacheSize / (particleBytes * particlesInCell);
+    _tileSize = std::max((int)std::cbrt(cellsInCache) - 2, 1);
+
+    // same-color tiles are one tile apart, which must hold the widest interaction radius
+    T   reach      = 2 * _h * std::cbrt((T)(1 << _levelInUse));
+    int reachCells = (int)std::ceil(reach / _pGridHelper.cellSize());
+    _tileSize = std::max(_tileSize, reachCells);
+
+    // across a periodic face the last tile is the gap, a narrower remainder is merged into it
+    for (int d = 0; d < 3; d++) {
+        int res = d == 0 ? _pGridHelper.resX() : d == 1 ? _pGridHelper.resY() : _pGridHelper.resZ();
+        _tileRes[d] = _periodicAxes[d] ? std::max(res / _tileSize, 1) : (res + _tileSize - 1) / _tileSize;
+    }
+
+    _tiles      = std::vector<std::vector<Index>>((size_t)_tileRes.x * _tileRes.y * _tileRes.z, std::vector<Index>());
+    _tileColors = std::vector<std::vector<int>>(27, std::vector<int>());
+
+    // tiles of same parity never touch, their halos can be read while they are solved concurrently
+    // an odd row of tiles closing on itself across a periodic face gives its last tile a third color
+    auto tileColor = [&](int t, int d) {
+        return _periodicAxes[d] && _tileRes[d] % 2 == 1 && _tileRes[d] > 1 && t == _tileRes[d] - 1 ? 2 : t & 1;
+    };
+
+    for (int k = 0; k < _tileRes.z; k++)
+        for (int j = 0; j < _tileRes.y; j++)
+            for (int i = 0; i < _tileRes.x; i++)
+                _tileColors[tileColor(i, 0) + 3 * tileColor(j, 1) + 9 * tileColor(k, 2)].push_back(i + j * _tileRes.x + k * _tileRes.x * _tileRes.y);
 }
 
-void IISPHsolver3D::computeError()
-{
-    _avgDensity = 0.0;
-    for (int i = 0; i < _fluidCount; i++)
-        _avgDensity += _Dcorr[i];
+template <class T, class A>
+void IISPHsolver3D<T, A>::buildSolverTiles() {
+    for (auto& tile : _tiles) {
+        size_t lastTileSize = tile.size();
+        tile.clear();
+        tile.reserve(lastTileSize);
+    }
+
+    for (int k = 0; k < _pGridHelper.resZ(); k++)
+        for (int j = 0; j < _pGridHelper.resY(); j++)
+            for (int i = 0; i < _pGridHelper.resX(); i++) {
+                int tileID = std::min(i / _tileSize, _tileRes.x - 1) + std::min(j / _tileSize, _tileRes.y - 1) * _tileRes.x
+                           + std::min(k / _tileSize, _tileRes.z - 1) * _tileRes.x * _tileRes.y;
+                std::vector<Index>& fluidInCell = _fGrid[_pGridHelper.cellID(i, j, k)];
+
+                for (Index p : fluidInCell)
+                    if (isActive(p))
+                        _tiles[tileID].push_back(p);
+            }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::solveTiles() {
+    // block Jacobi : local sweeps inside each tile, halo pressures exchanged between colors
+    for (auto& color : _tileColors) {
+        if (color.empty())
+            continue;
+
+#pragma omp parallel
+        {
+            DensityError<A> localError;
+
+#pragma omp for schedule(dynamic)
+            for (int t = 0; t < (int)color.size(); t++) {
+                std::vector<Index>& tile = _tiles[color[t]];
+
+                for (int l = 0; l < _localIterations; l++) {
+                    for (Index i : tile)
+                        storeSumDijPj(i);
+
+                    for (Index i : tile)
+                        computePressure(i);
+                }
+
+                for (Index i : tile)
+                    localError.add(_Dcorr[i] - _rho0);
+            }
 
-    _avgDensity /= _fPosition.size();
+            mergeError(localError);
+        }
+    }
 }
 
-void IISPHsolver3D::computePressureForces(int i) {
-    _Fp[i].x = 0.0f;
-    _Fp[i].y = 0.0f;
-    _Fp[i].z = 0.0f;
-    Vec3f pos_ij;
+template <class T, class A>
+void IISPHsolver3D<T, A>::computePressureForces(int i) {
+    Vec3A fp(0.0f);
+    Vec3A pos_ij;
 
     for (Index& j : _fNeighbors[i])
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-            _Fp[i] += -square(_m0) * (_fPressure[i] / square(_fDensity[i]) + _fPressure[j] / square(_fDensity[j])) * _pKernel.gradW(pos_ij);
+        if (!fluidOverlap(i, j)) {
+            pos_ij = fluidOffset(i, j);
+            fp += -fluidMass(i) * fluidMass(j) * (_fPressure[i] / square(_fDensity[i]) + frozenPressure(i, j) / square(_fDensity[j])) * fluidGradW(i, j, pos_ij);
         }
 
     for (Index& j : _bNeighbors[i])
-        if (_bPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _bPosition[j];
-            _Fp[i] += -_m0 * _Psi[j] * (_fPressure[i] / square(_fDensity[i])) * _pKernel.gradW(pos_ij);
+        if (!boundaryOverlap(i, j)) {
+            pos_ij = boundaryOffset(i, j);
+            fp += -fluidMass(i) * _Psi[j] * (_fPressure[i] / square(_fDensity[i])) * boundaryGradW(i, pos_ij);
         }
+
+    fp += -fluidMass(i) * (_fPressure[i] / square(_fDensity[i])) * wallGradient(i);
+
+    _Fp[i] = Vec3(fp);
 }
 
-void IISPHsolver3D::updateVelocity(int i) {
-    _fVelocity[i] = _Vadv[i] + _dt * _Fp[i] / _m0;
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateVelocity(int i) {
+    _fVelocity[i] = _Vadv[i] + _dt * _Fp[i] / fluidMass(i);
 }
 
-void IISPHsolver3D::updatePosition(int i) {
+template <class T, class A>
+void IISPHsolver3D<T, A>::updatePosition(int i) {
 
-    if (_pGridHelper.isInsideGrid(_fPosition[i] + _dt * _fVelocity[i]))
-        _fPosition[i] += _dt * _fVelocity[i];
-    else {
-        debugCrash(i);
+    Vec3 position = _fPosition[i] + _dt * _fVelocity[i];
+
+    // particles crossing a periodic face come back on the other side
+    if (_periodicBoundaries)
+        position = _pGridHelper.wrap(position);
+
+    // particles leaving the domain go back to the pool
+    if (_pGridHelper.isInsideGrid(position))
+        _fPosition[i] = position;
+    else
+        _fState[i] = SLOT_RETIRED;
+}
+
+
+
+/*--------------------------------------------Particle pool-------------------------------------------------*/
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::updatePool() {
+    // retire particles which left the domain or entered a sink
+    for (int i = 0; i < _fluidCount; i++) {
+        if (_fState[i] == SLOT_ALIVE)
+            for (auto& sink : _sinks)
+                if (sink.contains(_fPosition[i])) {
+                    _fState[i] = SLOT_RETIRED;
+                    break;
+                }
+
+        if (_fState[i] == SLOT_RETIRED)
+            retireParticle(i);
+    }
+
+    // emitters keep their volume filled, spawning where no particle is closer than the spacing
+    // the grid is rebuilt on the current positions without retired particles, spawns join it as they come
+    std::vector<Index> neighbors;
+    bool poolFull = false;
+
+    if (!_emitters.empty())
+        buildNeighborGrid();
+
+    for (size_t e = 0; e < _emitters.size() && !poolFull; e++)
+        for (auto& node : _emitters[e].nodes) {
+            neighbors.clear();
+            findFluidNeighbors(neighbors, Vec3(node), _h);
+            if (!neighbors.empty())
+                continue;
+
+            int i = spawnParticle(node, _emitters[e].velocity);
+            if (i < 0) {
+                poolFull = true;
+                break;
+            }
+            fillFluidGrid(i);
+        }
+
+    // move alive particles into the holes when slots get too scattered
+    if (_fluidCount > 0 && (T)_freeSlots.size() / _fluidCount > _maxFragmentation)
+        compactPool();
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::retireParticle(int i) {
+    // the blocks it reached are evaluated again at the next surface update
+    if (_temporalSurface && _fSurfaceBuilt[i])
+        _vacatedRefs.push_back(_fSurfaceRef[i]);
+
+    _fState[i]     = SLOT_FREE;
+    _fSurfaceBuilt[i] = 0;
+    _fVelocity[i]  = Vec3(0.0f);
+    _fPressure[i]  = 0.0f;
+    _fSleeping[i]  = 0;
+    _fRestSteps[i] = 0;
+    _fNeighbors[i].clear();
+    _bNeighbors[i].clear();
+
+    _freeSlots.push_back(i);
+    _aliveCount--;
+}
+
+template <class T, class A>
+int IISPHsolver3D<T, A>::spawnParticle(const Vec3f& position, const Vec3f& velocity) {
+    int i = 0;
+
+    if (!_freeSlots.empty()) {
+        i = (int)_freeSlots.back();
+        _freeSlots.pop_back();
+    }
+    else if (_fluidCount < _fluidCapacity)
+        i = _fluidCount++;
+    else
+        return -1;
+
+    _fState[i]     = SLOT_ALIVE;
+    _fPosition[i]  = Vec3(position);
+    _fVelocity[i]  = Vec3(velocity);
+    _Vadv[i]       = Vec3(velocity);
+    _fPressure[i]  = 0.0f;
+    _Pl[i]         = 0.0f;
+    _kappa[i]      = 0.0f;
+    _kappaV[i]     = 0.0f;
+    _Vvisc[i]      = Vec3(0.0f);
+    _Fadv[i]       = Vec3(0.0f);
+    _Fp[i]         = Vec3(0.0f);
+    _fDensity[i]   = _rho0;
+    _fColor[i]     = _denseColor;
+    _fSleeping[i]  = 0;
+    _fRestSteps[i] = 0;
+    _fMass[i]      = _m0;
+    _fSpacing[i]   = _h;
+    _fLevel[i]     = 0;
+    _fRebalance[i] = 0;
+    _fTimeLevel[i] = 0;
+    _fDensityShift[i] = 0.0f;
+    _fWallVolume[i]   = 0.0f;
+    _fWallGradient[i] = Vec3(0.0f);
+    _fWallCount[i]    = 0.0f;
+    _fSurfaceBuilt[i] = 0;
+
+    if (_quantizedPositions)
+        _fQuantized[i] = _pGridHelper.quantize(_fPosition[i]);
+
+    _aliveCount++;
+    return i;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::compactPool() {
+    int first = 0;
+    int last  = _fluidCount - 1;
+
+    while (true) {
+        while (first < last && _fState[first] == SLOT_ALIVE)
+            first++;
+        while (last > first && _fState[last] != SLOT_ALIVE)
+            last--;
+
+        if (first >= last)
+            break;
+
+        moveParticle(last, first);
     }
+
+    _fluidCount = _aliveCount;
+    _freeSlots.clear();
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::moveParticle(int from, int to) {
+    _fPosition[to]  = _fPosition[from];
+    _fVelocity[to]  = _fVelocity[from];
+    _fPressure[to]  = _fPressure[from];
+    _fDensity[to]   = _fDensity[from];
+    _fColor[to]     = _fColor[from];
+    _fSleeping[to]  = _fSleeping[from];
+    _fRestSteps[to] = _fRestSteps[from];
+    _fMass[to]      = _fMass[from];
+    _fSpacing[to]   = _fSpacing[from];
+    _fLevel[to]     = _fLevel[from];
+    _fRebalance[to] = _fRebalance[from];
+    _fTimeLevel[to] = _fTimeLevel[from];
+    _fDensityShift[to] = _fDensityShift[from];
+
+    // sleeping particles reuse their solver terms
+    _Dii[to]      = _Dii[from];
+    _Aii[to]      = _Aii[from];
+    _sumDijPj[to] = _sumDijPj[from];
+    _Vadv[to]     = _Vadv[from];
+    _Dadv[to]     = _Dadv[from];
+    _Pl[to]       = _Pl[from];
+    _kappa[to]    = _kappa[from];
+    _kappaV[to]   = _kappaV[from];
+    _Vvisc[to]    = _Vvisc[from];
+    _Dcorr[to]    = _Dcorr[from];
+    _Fadv[to]     = _Fadv[from];
+    _Fp[to]       = _Fp[from];
+
+    // swap keeps the capacity of both neighbor lists
+    std::swap(_fNeighbors[to], _fNeighbors[from]);
+    std::swap(_bNeighbors[to], _bNeighbors[from]);
+    _fNeighbors[from].clear();
+    _bNeighbors[from].clear();
+    _fWallVolume[to]   = _fWallVolume[from];
+    _fWallGradient[to] = _fWallGradient[from];
+    _fWallCount[to]    = _fWallCount[from];
+    _fSurfaceRef[to]   = _fSurfaceRef[from];
+    _fSurfaceBuilt[to] = _fSurfaceBuilt[from];
+    _fSurfaceBuilt[from] = 0;
+
+    _fState[to]   = SLOT_ALIVE;
+    _fState[from] = SLOT_FREE;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::mergeParticles(int i, int j) {
+    T mass = _fMass[i] + _fMass[j];
+
+    markRebalance(i);
+    markRebalance(j);
+
+    // center of mass and momentum are kept
+    _fPosition[i] = (_fMass[i] * _fPosition[i] + _fMass[j] * _fPosition[j]) / mass;
+    _fVelocity[i] = (_fMass[i] * _fVelocity[i] + _fMass[j] * _fVelocity[j]) / mass;
+    _Vvisc[i]     = (_fMass[i] * _Vvisc[i]     + _fMass[j] * _Vvisc[j])     / mass;
+    _fDensity[i]  = (_fMass[i] * _fDensity[i]  + _fMass[j] * _fDensity[j])  / mass;
+
+    _fMass[i]    = mass;
+    _fLevel[i]  += 1;
+    _fSpacing[i] = _h * std::cbrt((T)(1 << _fLevel[i]));
+
+    retireParticle(j);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::markRebalance(int i) {
+    _fRebalance[i] = 1;
+
+    for (Index& j : _fNeighbors[i])
+        _fRebalance[j] = 1;
+}
+
+template <class T, class A>
+bool IISPHsolver3D<T, A>::splitParticle(int i, int axis) {
+    int  level   = _fLevel[i] - 1;
+    T    spacing = _h * std::cbrt((T)(1 << level));
+    Vec3 offset(0.0f);
+    offset[axis] = 0.5f * spacing;
+
+    // children sit half a spacing on each side of the parent along the axis
+    if (!_pGridHelper.isInsideGrid(_fPosition[i] - offset) || !_pGridHelper.isInsideGrid(_fPosition[i] + offset))
+        return true;
+
+    int child = spawnParticle(Vec3f(_fPosition[i] + offset), Vec3f(_fVelocity[i]));
+    if (child < 0)
+        return false;
+
+    markRebalance(i);
+    _fRebalance[child] = 1;
+
+    _fPosition[i] -= offset;
+    _fMass[i]     *= 0.5f;
+    _fSpacing[i]   = spacing;
+    _fLevel[i]     = level;
+
+    _fMass[child]     = _fMass[i];
+    _fSpacing[child]  = spacing;
+    _fLevel[child]    = level;
+    _fVelocity[child] = _fVelocity[i];
+    _fDensity[child]  = _fDensity[i];
+    _fPressure[child] = _fPressure[i];
+    _kappa[child]     = _kappa[i];
+    _kappaV[child]    = _kappaV[i];
+    _Vvisc[child]     = _Vvisc[i];
+    return true;
 }
 
 
 
 /*---------------------------------------Surface reconstruction----------------------------------------------*/
 
-void IISPHsolver3D::computeDistanceField(int i, const float radius) {
-    Vec3f sumX = Vec3f(0.0f);
-    Real  sumK = 0.0f;
-    Real  temp = 0.0f;
-    Vec3f pos_ij;
+template <class T, class A>
+void IISPHsolver3D<T, A>::markBandCells() {
+    if (_bandCells.size() != (size_t)_pGridHelper.cellCount())
+        _bandCells = std::vector<char>((size_t)_pGridHelper.cellCount(), 0);
+
+    // cells holding fluid now, grown by the kernel reach : nodes out of the band have no neighbor
+    std::fill(_bandCells.begin(), _bandCells.end(), 0);
+
+    for (int i = 0; i < _fluidCount; i++)
+        if (_fState[i] == SLOT_ALIVE && _pGridHelper.isInsideGrid(_fPosition[i]))
+            _bandCells[_pGridHelper.cellID(_fPosition[i])] = 1;
+
+    int resX  = _pGridHelper.resX();
+    int resY  = _pGridHelper.resY();
+    int resZ  = _pGridHelper.resZ();
+    int reach = (int)std::ceil(2.0f * _h / _pGridHelper.cellSize()) + _bandMargin;
+
+    for (int pass = 0; pass < reach; pass++) {
+        std::vector<char> previous = _bandCells;
+
+#pragma omp parallel for
+        for (int k = 0; k < resZ; k++)
+            for (int j = 0; j < resY; j++)
+                for (int i = 0; i < resX; i++) {
+                    Index c = _pGridHelper.cellID(i, j, k);
+                    if (!previous[c])
+                        _bandCells[c] = _pGridHelper.anyAdjacentCell(i, j, k, [&](Index n) { return previous[n] != 0; });
+                }
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::surfaceNodeRange(int cell, int d, int& first, int& last) const {
+    Real ratio = _pGridHelper.cellSize() / _sGridHelper.cellSize();
+
+    // surface nodes on the closed interval of a particle cell
+    first = std::max((int)std::ceil(cell * ratio - 1e-4f), 0);
+    last  = std::min((int)std::floor((cell + 1) * ratio + 1e-4f), surfaceNodes(d) - 1);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateSurfaceBand() {
+    T outside = 2.0f * _h;
+
+    // first frame of the band, every node starts outside
+    if (_nodeInBand.size() != (size_t)_surfaceCount) {
+        _nodeInBand = std::vector<char>(_surfaceCount, 0);
+        _bandNodes.clear();
+        for (int n = 0; n < _surfaceCount; n++)
+            setSurfaceValue(n, outside);
+    }
+
+    // nodes of the last band fall back to the outside value
+    for (Index n : _bandNodes) {
+        setSurfaceValue(n, outside);
+        _nodeInBand[n]    = 0;
+    }
+    _bandNodes.clear();
+
+    markBandCells();
+
+    for (int k = 0; k < _pGridHelper.resZ(); k++)
+        for (int j = 0; j < _pGridHelper.resY(); j++)
+            for (int i = 0; i < _pGridHelper.resX(); i++) {
+                if (!_bandCells[_pGridHelper.cellID(i, j, k)])
+                    continue;
+
+                int xmin, xmax, ymin, ymax, zmin, zmax;
+                surfaceNodeRange(i, 0, xmin, xmax);
+                surfaceNodeRange(j, 1, ymin, ymax);
+                surfaceNodeRange(k, 2, zmin, zmax);
+
+                for (int z = zmin; z <= zmax; z++)
+                    for (int y = ymin; y <= ymax; y++)
+                        for (int x = xmin; x <= xmax; x++) {
+                            Index n = surfaceSlot(x, y, z);
+                            if (n < (Index)_surfaceCount && !_nodeInBand[n]) {
+                                _nodeInBand[n] = 1;
+                                _bandNodes.push_back(n);
+                            }
+                        }
+            }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateSurfaceBricks() {
+    _sparseField.clearBricks();
+    markBandCells();
+
+    // bricks covering the nodes of the band cells, every other node reads the outside background
+    int bits = SparseField<T>::brickBits;
+
+    for (int k = 0; k < _pGridHelper.resZ(); k++)
+        for (int j = 0; j < _pGridHelper.resY(); j++)
+            for (int i = 0; i < _pGridHelper.resX(); i++) {
+                if (!_bandCells[_pGridHelper.cellID(i, j, k)])
+                    continue;
+
+                int xmin, xmax, ymin, ymax, zmin, zmax;
+                surfaceNodeRange(i, 0, xmin, xmax);
+                surfaceNodeRange(j, 1, ymin, ymax);
+                surfaceNodeRange(k, 2, zmin, zmax);
+
+                for (int bz = zmin >> bits; bz <= zmax >> bits; bz++)
+                    for (int by = ymin >> bits; by <= ymax >> bits; by++)
+                        for (int bx = xmin >> bits; bx <= xmax >> bits; bx++)
+                            _sparseField.activateBrick(bx, by, bz);
+            }
+
+    _sparseField.allocateBricks();
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateDirtyBlocks() {
+    // node values only change in reach of particles which were added, removed or moved past the tolerance
+    for (const Vec3& ref : _vacatedRefs)
+        markSurfaceBlocks(ref);
+    _vacatedRefs.clear();
+
+    T squaredTolerance = square(_surfaceTolerance);
+
+    for (int i = 0; i < _fluidCount; i++) {
+        if (_fState[i] != SLOT_ALIVE)
+            continue;
+
+        if (!_fSurfaceBuilt[i]) {
+            markSurfaceBlocks(_fPosition[i]);
+            _fSurfaceBuilt[i] = 1;
+        }
+        else if (periodicOffset(_fPosition[i] - _fSurfaceRef[i]).lengthSquare() > squaredTolerance) {
+            markSurfaceBlocks(_fSurfaceRef[i]);
+            markSurfaceBlocks(_fPosition[i]);
+        }
+        else
+            continue;
+
+        _fSurfaceRef[i] = _fPosition[i];
+    }
+
+    _dirtyList.clear();
+    for (Index b = 0; b < (Index)_dirtyBlocks.size(); b++)
+        if (_dirtyBlocks[b])
+            _dirtyList.push_back(b);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::markSurfaceBlocks(const Vec3& position) {
+    Real cellSize = _sGridHelper.cellSize();
+    int  bits     = IsoSurface<T>::blockBits;
+
+    // blocks of the nodes in reach along each axis, the last node of a periodic axis repeats the first one
+    std::vector<int> blocks[3];
+
+    for (int d = 0; d < 3; d++) {
+        int first  = (int)std::ceil((position[d] - 2.0f * _h) / cellSize);
+        int last   = (int)std::floor((position[d] + 2.0f * _h) / cellSize);
+        int period = surfaceNodes(d) - 1;
+
+        if (!_periodicAxes[d]) {
+            first = std::max(first, 0);
+            last  = std::min(last, period);
+        }
+        else
+            last = std::min(last, first + period - 1);
+
+        for (int node = first; node <= last; node++) {
+            int wrapped = _periodicAxes[d] ? (node % period + period) % period : node;
+            blocks[d].push_back(wrapped >> bits);
+            if (_periodicAxes[d] && wrapped == 0)
+                blocks[d].push_back(period >> bits);
+        }
+
+        std::sort(blocks[d].begin(), blocks[d].end());
+        blocks[d].erase(std::unique(blocks[d].begin(), blocks[d].end()), blocks[d].end());
+    }
+
+    for (int bz : blocks[2])
+        for (int by : blocks[1])
+            for (int bx : blocks[0])
+                _dirtyBlocks[bx + by * _surfaceBlocks[0] + bz * _surfaceBlocks[0] * _surfaceBlocks[1]] = 1;
+}
+
+template <class T, class A>
+Index IISPHsolver3D<T, A>::buildSurfaceOctree() {
+    int size = 1;
+    while (2 * size <= _octreeCells)
+        size *= 2;
+
+    if (_nodeStamp.size() != (size_t)_surfaceCount)
+        _nodeStamp = std::vector<int>(_surfaceCount, 0);
+    _surfaceStamp++;
+
+    int resolution[3] = { _sGridHelper.resX(), _sGridHelper.resY(), _sGridHelper.resZ() };
+
+    // coarsest cells tile the grid, cells crossing its end are split until they fit
+    std::vector<OCTLEAF> cells, children;
+    for (int z = 0; z < resolution[2]; z += size)
+        for (int y = 0; y < resolution[1]; y += size)
+            for (int x = 0; x < resolution[0]; x += size)
+                cells.push_back({ (unsigned int)x, (unsigned int)y, (unsigned int)z, (unsigned int)size });
+
+    auto fits = [&](const OCTLEAF& cell) {
+        return cell.x + cell.size <= (unsigned int)resolution[0] && cell.y + cell.size <= (unsigned int)resolution[1] && cell.z + cell.size <= (unsigned int)resolution[2];
+    };
+
+    _octreeLeaves.clear();
+    std::vector<Index> nodes;
+    std::vector<char>  refine;
+    Index evaluated = 0;
+
+    while (!cells.empty()) {
+        // corners and centers of the level, each node evaluated once per reconstruction
+        nodes.clear();
+        for (const OCTLEAF& cell : cells) {
+            if (!fits(cell))
+                continue;
+
+            int half = cell.size / 2;
+            for (int c = 0; c < (cell.size > 1 ? 9 : 8); c++) {
+                int x = c < 8 ? cell.x + (c & 1) * cell.size : cell.x + half;
+                int y = c < 8 ? cell.y + ((c >> 1) & 1) * cell.size : cell.y + half;
+                int z = c < 8 ? cell.z + (c >> 2) * cell.size : cell.z + half;
+
+                Index n = surfaceSlot(x, y, z);
+                if (_nodeStamp[n] != _surfaceStamp) {
+                    _nodeStamp[n] = _surfaceStamp;
+                    nodes.push_back(n);
+                }
+            }
+        }
+
+#pragma omp parallel for
+        for (int k = 0; k < (int)nodes.size(); k++)
+            _distanceField[nodes[k]] = distanceAt(_sPosition[nodes[k]], 2.0f * _h);
+        evaluated += (Index)nodes.size();
+
+        refine.assign(cells.size(), 0);
+
+        // one neighbor buffer per thread, reused over its cells
+#pragma omp parallel
+        {
+            std::vector<Index> neighbors;
+
+#pragma omp for schedule(dynamic)
+            for (int k = 0; k < (int)cells.size(); k++)
+                refine[k] = !fits(cells[k]) || refineOctreeCell(cells[k], neighbors);
+        }
+
+        children.clear();
+        for (size_t k = 0; k < cells.size(); k++) {
+            if (!refine[k]) {
+                _octreeLeaves.push_back(cells[k]);
+                continue;
+            }
+
+            unsigned int half = cells[k].size / 2;
+            for (unsigned int c = 0; c < 8; c++) {
+                OCTLEAF child = { cells[k].x + (c & 1) * half, cells[k].y + ((c >> 1) & 1) * half, cells[k].z + (c >> 2) * half, half };
+                if (child.x < (unsigned int)resolution[0] && child.y < (unsigned int)resolution[1] && child.z < (unsigned int)resolution[2])
+                    children.push_back(child);
+            }
+        }
+
+        std::swap(cells, children);
+    }
+
+    return evaluated;
+}
+
+template <class T, class A>
+bool IISPHsolver3D<T, A>::refineOctreeCell(const OCTLEAF& cell, std::vector<Index>& neighbors) {
+    if (cell.size == 1)
+        return false;
+
+    Real cellSize = _sGridHelper.cellSize();
+    int  half     = cell.size / 2;
+    T    center   = _distanceField[surfaceSlot(cell.x + half, cell.y + half, cell.z + half)];
+
+    // cells out of reach of every particle hold no surface
+    T reach = 0.5f * std::sqrt(3.0f) * cell.size * cellSize;
+
+    neighbors.clear();
+    findFluidNeighbors(neighbors, _sPosition[surfaceSlot(cell.x + half, cell.y + half, cell.z + half)], reach + 2.0f * _h);
+    if (neighbors.empty())
+        return false;
+
+    // curvature : the center departs from the trilinear value, or a thin sheet crosses it between same sign corners
+    T    mean  = 0.0f;
+    bool below = false, above = false;
+
+    for (int c = 0; c < 8; c++) {
+        T value = _distanceField[surfaceSlot(cell.x + (c & 1) * cell.size, cell.y + ((c >> 1) & 1) * cell.size, cell.z + (c >> 2) * cell.size)];
+        mean  += value / 8;
+        below |= value < 0.0f;
+        above |= value >= 0.0f;
+    }
+
+    if (std::abs(center - mean) > _octreeFieldTolerance * cell.size * cellSize)
+        return true;
+    if ((center < 0.0f && !below) || (center >= 0.0f && !above))
+        return true;
+
+    // density variation : splashes and thin fluid regions keep fine cells
+    if (_octreeDensityTolerance > 0.0f) {
+        T minDensity = std::numeric_limits<T>::max(), maxDensity = 0.0f;
+        for (Index j : neighbors) {
+            minDensity = std::min(minDensity, _fDensity[j]);
+            maxDensity = std::max(maxDensity, _fDensity[j]);
+        }
+
+        if (maxDensity - minDensity > _octreeDensityTolerance * _rho0)
+            return true;
+    }
+
+    return false;
+}
+
+template <class T, class A>
+template <class F>
+void IISPHsolver3D<T, A>::forEachSurfaceNode(F f) {
+    if (_sparseSurface) {
+        int size = SparseField<T>::brickSize;
+
+#pragma omp parallel for
+        for (int b = 0; b < _sparseField.activeCount(); b++) {
+            int x0, y0, z0;
+            _sparseField.brickOrigin(b, x0, y0, z0);
+
+            for (int z = z0; z < z0 + size; z++)
+                for (int y = y0; y < y0 + size; y++)
+                    for (int x = x0; x < x0 + size; x++)
+                        if (_sparseField.inside(x, y, z)) {
+                            int slot = _sparseField.slot(x, y, z);
+                            f(slot, surfaceNode(slot, x, y, z));
+                        }
+        }
+    }
+    else if (_temporalSurface) {
+        int size = IsoSurface<T>::blockSize;
+
+#pragma omp parallel for schedule(dynamic)
+        for (int k = 0; k < (int)_dirtyList.size(); k++) {
+            int b  = _dirtyList[k];
+            int x0 = (b % _surfaceBlocks[0]) * size;
+            int y0 = (b / _surfaceBlocks[0] % _surfaceBlocks[1]) * size;
+            int z0 = (b / (_surfaceBlocks[0] * _surfaceBlocks[1])) * size;
+
+            for (int z = z0; z < std::min(z0 + size, surfaceNodes(2)); z++)
+                for (int y = y0; y < std::min(y0 + size, surfaceNodes(1)); y++)
+                    for (int x = x0; x < std::min(x0 + size, surfaceNodes(0)); x++) {
+                        int slot = surfaceSlot(x, y, z);
+                        f(slot, _sPosition[slot]);
+                    }
+        }
+    }
+    else if (_narrowBand) {
+#pragma omp parallel for
+        for (int k = 0; k < (int)_bandNodes.size(); k++)
+            f(_bandNodes[k], _sPosition[_bandNodes[k]]);
+    }
+    else {
+#pragma omp parallel for
+        for (int n = 0; n < _surfaceCount; n++)
+            f(n, _sPosition[n]);
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::splatDistanceField(const T radius) {
+    size_t slots = _sparseSurface ? (size_t)_sparseField.activeCount() * SparseField<T>::brickNodes : (size_t)_surfaceCount;
+
+    // sums are zero between frames, bricks only need the new slots
+    if (_splatWeight.size() != slots) {
+        _splatWeight.resize(slots, 0.0f);
+        _splatOffset.resize(slots, Vec3A(0.0f));
+    }
+
+    // particles bucketed by layer of particle cells, layers are the ownership slabs of the node planes
+    int slabCount = _pGridHelper.resZ();
+    int reach     = (int)std::ceil(radius / _pGridHelper.cellSize());
+    int planesZ   = _periodicAxes.z ? surfaceNodes(2) - 1 : surfaceNodes(2);
+    Real ratio    = _pGridHelper.cellSize() / _sGridHelper.cellSize();
+
+    _splatSlabs.resize(slabCount);
+    for (auto& slab : _splatSlabs)
+        slab.clear();
+
+    for (int i = 0; i < _fluidCount; i++)
+        if (_fState[i] == SLOT_ALIVE) {
+            int slab = clamp((int)std::floor(_fPosition[i].z / _pGridHelper.cellSize()), 0, slabCount - 1);
+            _splatSlabs[slab].push_back(i);
+        }
+
+#pragma omp parallel for schedule(dynamic)
+    for (int slab = 0; slab < slabCount; slab++) {
+        int zFirst = std::max((int)std::ceil(slab * ratio - 1e-4f), 0);
+        int zLast  = slab == slabCount - 1 ? planesZ - 1 : std::min((int)std::ceil((slab + 1) * ratio - 1e-4f), planesZ) - 1;
+
+        // layers in reach of the slab, once each when a periodic row is shorter than the stencil
+        std::vector<int> layers;
+        for (int ds = -reach; ds <= reach; ds++) {
+            int layer = slab + ds;
+            if (_periodicAxes.z)
+                layer = (layer % slabCount + slabCount) % slabCount;
+            else if (layer < 0 || layer >= slabCount)
+                continue;
+
+            if (std::find(layers.begin(), layers.end(), layer) == layers.end())
+                layers.push_back(layer);
+        }
+
+        for (int layer : layers)
+            for (Index j : _splatSlabs[layer])
+                splatParticle(j, zFirst, zLast, radius);
+    }
+
+    // one streaming pass turns the sums into distances and clears them for the next frame
+    forEachSurfaceNode([&](int slot, const Vec3& node) {
+        A sumK = _splatWeight[slot];
+
+        if (sumK < std::numeric_limits<T>::epsilon())
+            setSurfaceValue(slot, node.length() - _h / 2);
+        else
+            setSurfaceValue(slot, (_splatOffset[slot] / sumK).length() - _h / 2);
+
+        _splatWeight[slot] = 0.0f;
+        _splatOffset[slot] = Vec3A(0.0f);
+    });
+
+    // the last plane of a periodic axis is the image of the first one
+    for (int d = 0; d < 3; d++) {
+        if (!_periodicAxes[d])
+            continue;
+
+        int u = (d + 1) % 3, v = (d + 2) % 3;
+        for (int b = 0; b < surfaceNodes(v); b++)
+            for (int a = 0; a < surfaceNodes(u); a++) {
+                int first[3], last[3];
+                first[d] = 0;   last[d] = surfaceNodes(d) - 1;
+                first[u] = a;   last[u] = a;
+                first[v] = b;   last[v] = b;
+
+                int from = surfaceSlot(first[0], first[1], first[2]);
+                int to   = surfaceSlot(last[0], last[1], last[2]);
+                if (from >= 0 && to >= 0)
+                    copySurfaceValue(from, to);
+            }
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::splatParticle(int j, int zFirst, int zLast, const T radius) {
+    int  lo[3], hi[3];
+    Real cellSize = _sGridHelper.cellSize();
+
+    // stencil of the nodes in reach, wrapping on periodic axes where the last plane repeats the first
+    for (int d = 0; d < 3; d++) {
+        lo[d] = (int)std::ceil((_fPosition[j][d] - radius) / cellSize);
+        hi[d] = (int)std::floor((_fPosition[j][d] + radius) / cellSize);
+
+        if (!_periodicAxes[d]) {
+            lo[d] = std::max(lo[d], 0);
+            hi[d] = std::min(hi[d], surfaceNodes(d) - 1);
+        }
+    }
+
+    auto wrapNode = [&](int d, int node) {
+        int period = surfaceNodes(d) - 1;
+        return _periodicAxes[d] ? (node % period + period) % period : node;
+    };
+
+    T squaredRadius = square(radius);
+
+    for (int z = lo[2]; z <= hi[2]; z++) {
+        int zw = wrapNode(2, z);
+        if (zw < zFirst || zw > zLast)
+            continue;
+
+        for (int y = lo[1]; y <= hi[1]; y++) {
+            int yw = wrapNode(1, y);
+
+            for (int x = lo[0]; x <= hi[0]; x++) {
+                int xw   = wrapNode(0, x);
+                int slot = surfaceSlot(xw, yw, zw);
+                if (slot < 0)
+                    continue;
+
+                Vec3A pos_ij = periodicOffset(Vec3A(surfaceNode(slot, xw, yw, zw) - _fPosition[j]));
+                if (pos_ij.lengthSquare() >= squaredRadius)
+                    continue;
+
+                A W = _sKernel.W(pos_ij);
+                _splatWeight[slot] += W;
+                _splatOffset[slot] += W * pos_ij;
+            }
+        }
+    }
+}
+
+template <class T, class A>
+T IISPHsolver3D<T, A>::distanceAt(const Vec3& node, const T radius) {
+    Vec3A sumX = Vec3A(0.0f);
+    A     sumK = 0.0f;
+    A     temp = 0.0f;
+    Vec3A pos_ij;
 
     std::vector<Index> neighbors;
-    findFluidNeighbors(neighbors, _sPosition[i], radius);
+    findFluidNeighbors(neighbors, node, radius);
 
     for (Index& j : neighbors) {
-        pos_ij = _sPosition[i] - _fPosition[j];
+        pos_ij = Vec3A(node - _fPosition[j]);
         temp   = _sKernel.W(pos_ij);
-        sumX  += _fPosition[j] * temp;
+
+        // neighbors across a periodic face are taken at their image next to the node
+        if (_periodicBoundaries) {
+            pos_ij = periodicOffset(pos_ij);
+            temp   = _sKernel.W(pos_ij);
+            sumX  += (Vec3A(node) - pos_ij) * temp;
+        }
+        else
+            sumX  += Vec3A(_fPosition[j]) * temp;
         sumK  += temp;
     }
 
-    if (std::abs(sumK) < std::numeric_limits<Real>::epsilon()) {
-        if (std::abs(sumX.length()) < std::numeric_limits<Real>::epsilon())
-            _distanceField[i] = (_sPosition[i]).length() - _h / 2;
+    return distanceFromSums(node, sumX, sumK);
+}
+
+template <class T, class A>
+T IISPHsolver3D<T, A>::distanceFromSums(const Vec3& node, const Vec3A& sumX, const A sumK) const {
+    if (std::abs(sumK) < std::numeric_limits<T>::epsilon()) {
+        if (std::abs(sumX.length()) < std::numeric_limits<T>::epsilon())
+            return node.length() - _h / 2;
         else
-            _distanceField[i] = 0.0f;
+            return 0.0f;
     }
 
-    else {
-        _distanceField[i] = (_sPosition[i] - sumX / sumK).length() - _h / 2;
+    return (Vec3A(node) - sumX / sumK).length() - _h / 2;
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::computeDistanceField(int i, const T radius) {
+    setSurfaceValue(i, distanceAt(_sPosition[i], radius));
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::gatherDistanceField(const T radius) {
+    // band nodes are scattered, they keep the search per node
+    if (!_sparseSurface && !_temporalSurface && _narrowBand) {
+        forEachSurfaceNode([&](int slot, const Vec3& node) { setSurfaceValue(slot, distanceAt(node, radius)); });
+        return;
+    }
+
+    // bricks covering the active bricks, the dirty blocks or the whole grid
+    std::vector<Vec3i> bricks;
+    auto addBricks = [&](int x0, int y0, int z0, int size) {
+        for (int z = z0; z < std::min(z0 + size, surfaceNodes(2)); z += gatherBrickSize)
+            for (int y = y0; y < std::min(y0 + size, surfaceNodes(1)); y += gatherBrickSize)
+                for (int x = x0; x < std::min(x0 + size, surfaceNodes(0)); x += gatherBrickSize)
+                    bricks.push_back(Vec3i(x, y, z));
+    };
+
+    if (_sparseSurface) {
+        for (int b = 0; b < _sparseField.activeCount(); b++) {
+            int x0, y0, z0;
+            _sparseField.brickOrigin(b, x0, y0, z0);
+            addBricks(x0, y0, z0, SparseField<T>::brickSize);
+        }
+    }
+    else if (_temporalSurface) {
+        int size = IsoSurface<T>::blockSize;
+        for (Index b : _dirtyList)
+            addBricks((b % _surfaceBlocks[0]) * size, (b / _surfaceBlocks[0] % _surfaceBlocks[1]) * size,
+                      (b / (_surfaceBlocks[0] * _surfaceBlocks[1])) * size, size);
+    }
+    else
+        addBricks(0, 0, 0, std::max(surfaceNodes(0), std::max(surfaceNodes(1), surfaceNodes(2))));
+
+#pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < (int)bricks.size(); k++)
+        gatherBrick(bricks[k].x, bricks[k].y, bricks[k].z, radius);
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::gatherBrick(int x0, int y0, int z0, const T radius) {
+    const int maxNodes = gatherBrickSize * gatherBrickSize * gatherBrickSize;
+    int   slots[maxNodes];
+    Vec3  nodes[maxNodes];
+    bool  inside[maxNodes];
+    A     nodeX[maxNodes], nodeY[maxNodes], nodeZ[maxNodes];
+    A     sumX[maxNodes], sumY[maxNodes], sumZ[maxNodes], sumK[maxNodes];
+    int   count = 0;
+
+    Vec3 boxMin = Vec3(std::numeric_limits<T>::max());
+    Vec3 boxMax = Vec3(-std::numeric_limits<T>::max());
+
+    for (int z = z0; z < std::min(z0 + gatherBrickSize, surfaceNodes(2)); z++)
+        for (int y = y0; y < std::min(y0 + gatherBrickSize, surfaceNodes(1)); y++)
+            for (int x = x0; x < std::min(x0 + gatherBrickSize, surfaceNodes(0)); x++) {
+                int slot = surfaceSlot(x, y, z);
+                if (slot < 0)
+                    continue;
+
+                Vec3 node = surfaceNode(slot, x, y, z);
+                for (int d = 0; d < 3; d++) {
+                    boxMin[d] = std::min(boxMin[d], node[d]);
+                    boxMax[d] = std::max(boxMax[d], node[d]);
+                }
+
+                // nodes the search per node sees outside the grid have no neighbors there either
+                inside[count] = _pGridHelper.isInsideGrid(Vec3f(node));
+                slots[count]  = slot;
+                nodes[count]  = node;
+                nodeX[count]  = node.x;
+                nodeY[count]  = node.y;
+                nodeZ[count]  = node.z;
+                sumX[count] = sumY[count] = sumZ[count] = sumK[count] = 0.0f;
+                count++;
+            }
+
+    if (count == 0)
+        return;
+
+    // one search for the whole brick : fluid of the cells around its box grown by the radius, taken at
+    // its image next to the box center across periodic faces (periods are wider than box and radius)
+    Vec3 center = (boxMin + boxMax) / 2;
+    T    extent = std::max((boxMax.x - boxMin.x), std::max(boxMax.y - boxMin.y, boxMax.z - boxMin.z)) / 2;
+    T    squaredRadius = square(radius);
+
+    std::vector<Index> neighborCells;
+    std::vector<A>     candX, candY, candZ;
+    _pGridHelper.getNeighborCells(neighborCells, Vec3f(center), extent + radius);
+
+    for (Index c : neighborCells) {
+        const std::vector<Index>& fluidInCell = _fGrid[c];
+
+        for (Index j : fluidInCell) {
+            Vec3 position = _periodicBoundaries ? center + periodicOffset(_fPosition[j] - center) : _fPosition[j];
+
+            // candidates out of reach of every node of the box are dropped
+            T distance = 0.0f;
+            for (int d = 0; d < 3; d++)
+                distance += square(std::max(T(0), std::max(boxMin[d] - position[d], position[d] - boxMax[d])));
+
+            if (distance < squaredRadius) {
+                candX.push_back(position.x);
+                candY.push_back(position.y);
+                candZ.push_back(position.z);
+            }
+        }
+    }
+
+    // candidates outside, nodes of the brick inside the vectorized loop
+    A reach = squaredRadius;
+    for (size_t j = 0; j < candX.size(); j++) {
+        A px = candX[j], py = candY[j], pz = candZ[j];
+
+#pragma omp simd
+        for (int n = 0; n < count; n++) {
+            A dx = nodeX[n] - px, dy = nodeY[n] - py, dz = nodeZ[n] - pz;
+            A distance = dx * dx + dy * dy + dz * dz;
+            A temp = distance < reach ? _sKernel.kSquare(distance) : A(0);
+
+            sumX[n] += px * temp;
+            sumY[n] += py * temp;
+            sumZ[n] += pz * temp;
+            sumK[n] += temp;
+        }
+    }
+
+    for (int n = 0; n < count; n++) {
+        if (inside[n])
+            setSurfaceValue(slots[n], distanceFromSums(nodes[n], Vec3A(sumX[n], sumY[n], sumZ[n]), sumK[n]));
+        else
+            setSurfaceValue(slots[n], distanceFromSums(nodes[n], Vec3A(0.0f), 0.0f));
+    }
+}
+
+template <class T, class A>
+void IISPHsolver3D<T, A>::generateIsoSurface() {
+    // 16-bit fields run the short instantiations of the dense extractors
+    if (_quantizedSurface) {
+        switch (_surfaceExtraction) {
+        case FLYING_EDGES:
+            extractDenseSurface(_flyingEdges16, _quantizedField.data());
+            break;
+        case SURFACE_NETS:
+            extractDenseSurface(_surfaceNets16, _quantizedField.data());
+            break;
+        default:
+            extractDenseSurface(_isoSurface16, _quantizedField.data());
+        }
+        return;
+    }
+
+    switch (_surfaceExtraction) {
+    case FLYING_EDGES:
+        extractSurface(_flyingEdges);
+        break;
+    case SURFACE_NETS:
+        extractSurface(_surfaceNets);
+        break;
+    case ADAPTIVE_OCTREE:
+        _octreeSurface.GenerateSurface(
+            _distanceField.data(), _octreeLeaves, 0.0f,
+            _sGridHelper.resX(), _sGridHelper.resY(), _sGridHelper.resZ(),
+            _sGridHelper.cellSize(), _sGridHelper.cellSize(), _sGridHelper.cellSize()
+        );
+        storeMesh(_octreeSurface);
+        break;
+    default:
+        if (_temporalSurface)
+            updateIsoSurface();
+        else
+            extractSurface(_isoSurface);
+    }
+}
+
+template <class T, class A>
+template <class S>
+void IISPHsolver3D<T, A>::extractSurface(S& extractor) {
+    if (!_sparseSurface) {
+        extractDenseSurface(extractor, _distanceField.data());
+        return;
     }
+
+    extractor.GenerateSurface(_sparseField, 0.0f, _sGridHelper.cellSize(), _sGridHelper.cellSize(), _sGridHelper.cellSize());
+    storeMesh(extractor);
 }
 
-void IISPHsolver3D::generateIsoSurface() {
-    _isoSurface.GenerateSurface(
-        _distanceField.data(), 0.0f,
+template <class T, class A>
+template <class S, class V>
+void IISPHsolver3D<T, A>::extractDenseSurface(S& extractor, const V* field) {
+    extractor.GenerateSurface(
+        field, (V)0,
         _sGridHelper.resX(), _sGridHelper.resY(), _sGridHelper.resZ(),
         _sGridHelper.cellSize(), _sGridHelper.cellSize(), _sGridHelper.cellSize()
     );
+    storeMesh(extractor);
+}
+
+template <class T, class A>
+template <class S>
+void IISPHsolver3D<T, A>::storeMesh(const S& extractor) {
+    _meshVertices      = extractor.m_ppt3dVertices;
+    _meshIndices       = extractor.m_piTriangleIndices;
+    _meshVertexCount   = extractor.m_nVertices;
+    _meshTriangleCount = extractor.m_nTriangles;
 }
 
+template <class T, class A>
+void IISPHsolver3D<T, A>::updateIsoSurface() {
+    // blocks left clean keep their triangles from the last frame
+    _isoSurface.UpdateSurface(
+        _distanceField.data(), (const unsigned char*)_dirtyBlocks.data(), 0.0f,
+        _sGridHelper.resX(), _sGridHelper.resY(), _sGridHelper.resZ(),
+        _sGridHelper.cellSize(), _sGridHelper.cellSize(), _sGridHelper.cellSize()
+    );
+    storeMesh(_isoSurface);
+
+    for (Index b : _dirtyList)
+        _dirtyBlocks[b] = 0;
+}
 
 
 /*----------------------------------------Debug / visualization-----------------------------------------------*/
 
-void IISPHsolver3D::visualizeFluidDensity() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::visualizeFluidDensity() {
     for (Index i = 0; i < _fluidCount; i++) {
         _fColor[i].x = _lightColor.x + (_fDensity[i] / _rho0) * (_denseColor.x - _lightColor.x);
         _fColor[i].y = _lightColor.y + (_fDensity[i] / _rho0) * (_denseColor.y - _lightColor.y);
@@ -559,7 +3009,8 @@ void IISPHsolver3D::visualizeFluidDensity() {
     }
 }
 
-void IISPHsolver3D::visualizeBoundaryDensity() {
+template <class T, class A>
+void IISPHsolver3D<T, A>::visualizeBoundaryDensity() {
     for (Index i = 0; i < _boundaryCount; i++) {
         _bColor[i].x = _lightColor.x + (_Psi[i] / _rho0) * (_wallColor.x - _lightColor.x);
         _bColor[i].y = _lightColor.y + (_Psi[i] / _rho0) * (_wallColor.y - _lightColor.y);
@@ -567,7 +3018,8 @@ void IISPHsolver3D::visualizeBoundaryDensity() {
     }
 }
 
-void IISPHsolver3D::visualizeFluidNeighbors(int i) {
+template <class T, class A>
+void IISPHsolver3D<T, A>::visualizeFluidNeighbors(int i) {
 
     for (Index& j : _fNeighbors[i])
         _fColor[j] = _greenColor;
@@ -578,51 +3030,6 @@ void IISPHsolver3D::visualizeFluidNeighbors(int i) {
     _fColor[i] = _redColor;
 }
 
-void IISPHsolver3D::debugCrash(int i) {
-    std::cout
-        << "position     : " << _fPosition[i] << "\n"
-        << "velocity     : " << _fVelocity[i] << "\n"
-        << "pressure     : " << _fPressure[i] << "\n"
-        << "density      : " << _fDensity[i]  << "\n"
-        << "F_p          : " << _Fp[i]        << "\n"
-        << "rho_corr     : " << _Dcorr[i]     << "\n"
-        << "sum d_ij p_j : " << _sumDijPj[i]  << "\n"
-        << "a_ii         : " << _Aii[i]       << "\n"
-        << "rho_adv      : " << _Dadv[i]      << "\n"
-        << "d_ii         : " << _Dii[i]       << "\n"
-        << "v_adv        : " << _Vadv[i]      << "\n"
-        << "F_adv        : " << _Fadv[i]      << "\n"
-        << std::endl;
-
-    std::cout << "neighbors : \n";
-
-    Vec3f pos_ij;
-
-    for (Index j : _fNeighbors[i]) {
-        if (_fPosition[j] != _fPosition[i]) {
-            pos_ij = _fPosition[i] - _fPosition[j];
-
-            std::cout
-                << "    position     : " << _fPosition[j] << "\n"
-                << "    velocity     : " << _fVelocity[j] << "\n"
-                << "    pressure     : " << _fPressure[j] << "\n"
-                << "    density      : " << _fDensity[j]  << "\n"
-                << "    F_p          : " << _Fp[j]        << "\n"
-                << "    rho_corr     : " << _Dcorr[i]     << "\n"
-                << "    sum d_ij p_j : " << _sumDijPj[j]  << "\n"
-                << "    a_ii         : " << _Aii[j]       << "\n"
-                << "    rho_adv      : " << _Dadv[j]      << "\n"
-                << "    d_ii         : " << _Dii[j]       << "\n"
-                << "    v_adv        : " << _Vadv[j]      << "\n"
-                << "    F_adv        : " << _Fadv[j]      << "\n"
-                << "    gradient     : " << _pKernel.gradW(pos_ij) << "\n"
-                << std::endl;
-        }
-    }
-    std::cout << "---------------------------------------------\n\n" << std::endl;
-}
-
-
 
 /*--------------------------------------------In development---------------------------------------------------*/
 
@@ -674,3 +3081,7 @@ std::vector<Vec3f> mesh_to_set_of_points(std::vector<Vec3f> points, std::vector<
 
     return r_points;
 }
+
+template class IISPHsolver3D<float>;
+template class IISPHsolver3D<float, double>;
+template class IISPHsolver3D<double>;
@@ -5,6 +5,9 @@
 #include "sph_sampler.h"
 
 #include "../Surface/IsoSurface.h"
+#include "../Surface/FlyingEdges.h"
+#include "../Surface/SurfaceNets.h"
+#include "../Surface/OctreeSurface.h"
 
 #include <numeric>
 #include <algorithm>
@@ -15,14 +18,88 @@
 typedef std::chrono::high_resolution_clock Clock;
 
 
+// pressure solver : implicit incompressible SPH, or divergence-free SPH
+enum SolverMode { IISPH_SOLVER, DFSPH_SOLVER };
+
+// backend turning the distance field into a mesh
+enum SurfaceExtraction { MARCHING_CUBES, FLYING_EDGES, SURFACE_NETS, ADAPTIVE_OCTREE };
+
+// stopping criterion of the pressure solve
+enum ToleranceMode {
+    AVERAGE_ERROR,          // average density error below eta
+    MAX_ERROR,              // maximum density error below max eta
+    AVERAGE_AND_MAX_ERROR   // both of the above
+};
+
+// state of a slot of the fluid particle pool
+enum SlotState { SLOT_FREE, SLOT_ALIVE, SLOT_RETIRED };
+
+// axis-aligned box where fluid particles are spawned or retired
+struct FluidVolume {
+    Vec3f bottomLeft;
+    Vec3f topRight;
+    Vec3f velocity;             // velocity of spawned particles
+    std::vector<Vec3f> nodes;   // spawn positions, sampled at the particle spacing
+
+    template <class V>
+    inline bool contains(const V& p) const {
+        return p.x >= bottomLeft.x && p.y >= bottomLeft.y && p.z >= bottomLeft.z
+            && p.x <  topRight.x   && p.y <  topRight.y   && p.z <  topRight.z;
+    }
+};
+
+// rigid group of boundary particles moved kinematically, the rest of the boundary stays static
+template <class T>
+struct BoundaryGroup {
+    Index first = 0;                    // first boundary particle of the group
+    std::vector<Vector3<T>> local;      // samples in the group frame
+    std::vector<Index>      cells;      // grid cell of each sample
+    Vector3<T> center;                  // pivot, origin of the group frame
+    Vector3<T> frame[3];                // axes of the group frame
+    Vector3<T> velocity;                // linear velocity of the pivot
+    Vector3<T> angularVelocity;         // angular velocity around the pivot
+
+    inline bool isMoving() const { return velocity != Vector3<T>(0.0f) || angularVelocity != Vector3<T>(0.0f); }
+};
+
+// density error gathered while pressure is being computed
+template <class A>
+struct DensityError {
+    A   sum        = 0;
+    A   max        = 0;
+    int count      = 0;
+    int compressed = 0;
+
+    inline void add(const A error) {
+        sum += error;
+        max  = std::max(max, error);
+        count++;
+        compressed += error > 0 ? 1 : 0;
+    }
+
+    inline void merge(const DensityError& other) {
+        sum += other.sum;
+        max  = std::max(max, other.max);
+        count      += other.count;
+        compressed += other.compressed;
+    }
+
+    inline A average() const { return count > 0 ? sum / count : 0; }
+};
+
+
+template <class T, class A = T>
 class IISPHsolver3D
 {
 public:
+    typedef Vector3<T> Vec3;    // storage precision
+    typedef Vector3<A> Vec3A;   // accumulation precision
+
     explicit IISPHsolver3D(
-        const Real h    = 0.5f,    // particle spacing
-        const Real rho0 = 1e3f,    // rest density
-        const Real nu   = 0.08f,   // kinematic viscosity
-        const Real eta  = 0.01f)   // compressibility
+        const T h    = 0.5f,    // particle spacing
+        const T rho0 = 1e3f,    // rest density
+        const T nu   = 0.08f,   // kinematic viscosity
+        const T eta  = 0.01f)   // compressibility
     {
         // fluid properties
         _h    = h;
@@ -32,18 +109,21 @@ public:
 
         // fixed constants
         _dt = 0.00835f; // 120fps
-        _g  = Vec3f(0.0f, -9.81f, 0.0f);
+        _g  = Vec3(0.0f, -9.81f, 0.0f);
         _omega = 0.5f;
 
         // derived properties
         _m0 = _rho0 * cube(_h);
         _c  = std::fabs(_g.y) / _eta;
+        _maxEta = 10 * _eta;    // peaks run about an order of magnitude above the average
     }
 
     /*-------------------------------------------Main functions------------------------------------------------*/
 
     void prepareSolver(std::vector<Vec3f> fluidPos, std::vector<Vec3f> boundaryPos);
+    int  addBoundaryGroup(const std::vector<Vec3f>& positions, Vec3f center);
     void solveSimulation();
+    void advanceFrame(T frameTime);
     void reconstructSurface();
 
     void showGeneralStatistics();
@@ -55,27 +135,118 @@ public:
 
     inline void setParticleHelper(Real cellSize, Vec3f gridSize) { _pGridHelper = GridHelper(cellSize, gridSize); }
     inline void setSurfaceHelper (Real cellSize, Vec3f gridSize) { _sGridHelper = GridHelper(cellSize, gridSize); }
+    inline void setSolverMode(SolverMode mode) { _solverMode = mode; }
+    inline void setTiledSolve(bool enabled, int localIterations = 2, size_t cacheSize = 1 << 20) {
+        _tiledSolve      = enabled;
+        _localIterations = localIterations;
+        _cacheSize       = cacheSize;
+    }
+    inline void setConvergence(int minIterations, int maxIterations, ToleranceMode mode = AVERAGE_ERROR) {
+        _minIterations = minIterations;
+        _maxIterations = maxIterations;
+        _toleranceMode = mode;
+    }
+    // bound on the maximum density error, in kg/m^3 as eta
+    inline void setMaxCompressibility(T maxEta) { _maxEta = maxEta; }
+    inline void setAdaptiveResolution(bool enabled, int maxLevel = 3, int fineDepth = 2) {
+        _adaptiveResolution = enabled;
+        _maxLevel           = maxLevel;
+        _fineDepth          = fineDepth;
+    }
+    inline void setImplicitViscosity(bool enabled, T tolerance = 0.01f, int maxIterations = 100) {
+        _implicitViscosity      = enabled;
+        _viscosityTolerance     = tolerance;
+        _maxViscosityIterations = maxIterations;
+    }
+    inline void setQuantizedPositions(bool enabled) { _quantizedPositions = enabled; }
+    inline void setQuantizedSurface(bool enabled) { _quantizedSurface = enabled; }
+    inline void setParticlePool(int capacity) { _fluidCapacity = capacity; }
+    inline void setPeriodicBoundaries(bool x, bool y, bool z) { _periodicAxes = Vec3i(x, y, z); }
+    inline void setBoundarySpacing(T spacing) { _boundarySpacing = spacing; }
+    inline void setSurfaceSplatting(bool enabled) { _surfaceSplatting = enabled; }
+    inline void setSurfaceExtraction(SurfaceExtraction extraction) { _surfaceExtraction = extraction; }
+    inline void setNarrowBand(bool enabled, int margin = 0) {
+        _narrowBand = enabled;
+        _bandMargin = margin;
+        _nodeInBand.clear();
+        _bandNodes.clear();
+    }
+    inline void setSparseSurface(bool enabled, int denseNodes = 1 << 18) {
+        _sparseSurface = enabled;
+        _denseNodes    = denseNodes;
+    }
+    inline void setOctreeRefinement(int coarsestCells = 8, T fieldTolerance = 0.1f, T densityTolerance = 0.25f) {
+        _octreeCells            = coarsestCells;
+        _octreeFieldTolerance   = fieldTolerance;
+        _octreeDensityTolerance = densityTolerance;
+    }
+    inline void setTemporalSurface(bool enabled, T tolerance = 0.0f) {
+        _temporalSurface  = enabled;
+        _surfaceTolerance = tolerance;
+    }
+    inline void setImplicitBoundaries(bool enabled, T mapSpacing = 0.0f) {
+        _implicitBoundaries = enabled;
+        _mapSpacing         = mapSpacing;
+    }
+    inline void addEmitter(Vec3f bottomLeft, Vec3f topRight, Vec3f velocity) { _emitters.push_back({ bottomLeft, topRight, velocity, {} }); }
+    inline void addSink(Vec3f bottomLeft, Vec3f topRight) { _sinks.push_back({ bottomLeft, topRight, Vec3f(0.0f), {} }); }
+    inline void setBoundaryMotion(int group, Vec3f velocity, Vec3f angularVelocity) {
+        _bGroups[group].velocity        = Vec3(velocity);
+        _bGroups[group].angularVelocity = Vec3(angularVelocity);
+    }
+    inline void setSleeping(bool enabled, T velocity = 0.01f, T densityError = 0.01f, int steps = 30) {
+        _sleeping      = enabled;
+        _sleepVelocity = velocity;
+        _sleepDensity  = densityError;
+        _sleepSteps    = steps;
+    }
+    inline void setLocalTimeStepping(bool enabled, int maxLevel = 2) {
+        _localTimeStepping = enabled;
+        _maxTimeLevel      = maxLevel;
+        _localStep         = 0;
+        _levelCount.assign(maxLevel + 1, 0);
+    }
+    inline void setAdaptiveTimeStep(bool enabled, T cfl = 0.4f, T dtMin = 1e-4f, T dtMax = 1.0f / 60, int iterationBudget = 10) {
+        _adaptiveTimeStep = enabled;
+        _cfl             = cfl;
+        _dtMin           = dtMin;
+        _dtMax           = dtMax;
+        _iterationBudget = iterationBudget;
+    }
 
     const inline GridHelper getParticleHelper() { return _pGridHelper; }
     const inline GridHelper getSurfaceHelper()  { return _sGridHelper; }
 
     const inline Index  fluidCount()                 const { return _fluidCount; }
-    const inline Vec3f& fluidPosition(const Index i) const { return _fPosition[i]; }
+    const inline Index  fluidCapacity()              const { return _fluidCapacity; }
+    const inline Index  aliveCount()                 const { return _aliveCount; }
+    const inline bool   fluidAlive(const Index i)    const { return _fState[i] == SLOT_ALIVE; }
+    const inline Vec3&  fluidPosition(const Index i) const { return _fPosition[i]; }
+    const inline T      fluidSpacing(const Index i)  const { return _adaptiveResolution ? _fSpacing[i] : _h; }
     const inline Vec3f& fluidColor(const Index i)    const { return _fColor[i]; }
 
     const inline Index  boundaryCount()                 const { return _inBoundaryCount; }
-    const inline Vec3f& boundaryPosition(const Index i) const { return _bPosition[i]; }
+    const inline Vec3&  boundaryPosition(const Index i) const { return _bPosition[i]; }
     const inline Vec3f& boundaryColor(const Index i)    const { return _bColor[i]; }
+    const inline bool   movingBoundaries() const {
+        for (auto& group : _bGroups)
+            if (group.isMoving())
+                return true;
+        return false;
+    }
 
     const inline Vec3f size()            const { return _pGridHelper.size(); }
     const inline Real  cellSize()        const { return _pGridHelper.cellSize(); }
-    const inline Real  particleSpacing() const { return _h; };
+    const inline T     particleSpacing() const { return _h; };
+    const inline T     timeStep()        const { return _dt; };
 
-    const inline Index verticesCount() const { return _isoSurface.m_nVertices; }
-    const inline Index indicesCount()  const { return _isoSurface.m_nTriangles * 3; }
+    const inline SurfaceExtraction surfaceExtraction() const { return _surfaceExtraction; }
 
-    const inline POINT3D*      vertices() const { return _isoSurface.m_ppt3dVertices; }
-    const inline unsigned int* indices()  const { return _isoSurface.m_piTriangleIndices; }
+    const inline Index verticesCount() const { return _meshVertexCount; }
+    const inline Index indicesCount()  const { return _meshTriangleCount * 3; }
+
+    const inline POINT3D*      vertices() const { return _meshVertices; }
+    const inline unsigned int* indices()  const { return _meshIndices; }
 
     
 private:
@@ -86,8 +257,55 @@ private:
 
     void fillFluidGrid(int i);
     void fillBoundaryGrid(int i);
-    void findFluidNeighbors(std::vector< Index >& neighbors, Vec3f position, const float radius);
-    void findBoundaryNeighbors(std::vector< Index >& neighbors, Vec3f position, const float radius);
+    void moveBoundaries();
+    void findFluidNeighbors(std::vector< Index >& neighbors, Vec3 position, const T radius);
+    void findBoundaryNeighbors(std::vector< Index >& neighbors, Vec3 position, const T radius);
+    void bakeBoundaryMaps();
+    void sampleBoundaryMaps(int i);
+
+    // x_i - x_j of fluid particle i and neighbor j, decoded from quantized positions when enabled
+    inline Vec3A fluidOffset(Index i, Index j) const {
+        if (_quantizedPositions)
+            return _pGridHelper.relativePosition<A>(_fQuantized[i], _fQuantized[j]);
+        return periodicOffset(Vec3A(_fPosition[i] - _fPosition[j]));
+    }
+    inline Vec3A boundaryOffset(Index i, Index j) const {
+        if (_quantizedPositions)
+            return _pGridHelper.relativePosition<A>(_fQuantized[i], _bQuantized[j]);
+        return periodicOffset(Vec3A(_fPosition[i] - _bPosition[j]));
+    }
+    // minimum image of an offset along periodic axes
+    template<class V>
+    inline V periodicOffset(const V& offset) const {
+        return _periodicBoundaries ? _pGridHelper.minimumImage(offset) : offset;
+    }
+    inline bool fluidOverlap(Index i, Index j) const {
+        return _quantizedPositions ? _fQuantized[i] == _fQuantized[j] : _fPosition[i] == _fPosition[j];
+    }
+    inline bool boundaryOverlap(Index i, Index j) const {
+        return _quantizedPositions ? _fQuantized[i] == _bQuantized[j] : _fPosition[i] == _bPosition[j];
+    }
+
+    // mass and kernels of a pair, smoothing length is averaged when particles have their own resolution
+    inline T fluidMass(Index i) const { return _adaptiveResolution ? _fMass[i] : _m0; }
+    inline A fluidW(Index i, Index j, const Vec3A& pos_ij) const {
+        return _adaptiveResolution ? _pKernel.scaledW(pos_ij, (A)0.5f * (_fSpacing[i] + _fSpacing[j])) : _pKernel.W(pos_ij);
+    }
+    // static walls of implicit boundaries, sampled once per step from the boundary maps
+    inline A     wallVolume(Index i)   const { return _implicitBoundaries ? (A)_fWallVolume[i] : (A)0; }
+    inline Vec3A wallGradient(Index i) const { return _implicitBoundaries ? Vec3A(_fWallGradient[i]) : Vec3A(0.0f); }
+    inline int   neighborCount(Index i) const {
+        return (int)(_fNeighbors[i].size() + _bNeighbors[i].size()) + (_implicitBoundaries ? (int)_fWallCount[i] : 0);
+    }
+    inline Vec3A fluidGradW(Index i, Index j, const Vec3A& pos_ij) const {
+        return _adaptiveResolution ? _pKernel.scaledGradW(pos_ij, (A)0.5f * (_fSpacing[i] + _fSpacing[j])) : _pKernel.gradW(pos_ij);
+    }
+    inline A boundaryW(Index i, const Vec3A& pos_ij) const {
+        return _adaptiveResolution ? _pKernel.scaledW(pos_ij, (A)0.5f * (_fSpacing[i] + _h)) : _pKernel.W(pos_ij);
+    }
+    inline Vec3A boundaryGradW(Index i, const Vec3A& pos_ij) const {
+        return _adaptiveResolution ? _pKernel.scaledGradW(pos_ij, (A)0.5f * (_fSpacing[i] + _h)) : _pKernel.gradW(pos_ij);
+    }
 
 
     /*-----------------------------------------Particle simulation------------------------------------------------*/
@@ -95,7 +313,34 @@ private:
     void predictAdvection();
     void pressureSolve();
     void integration();
+    void computeTimeStep(T remainingTime);
+    T maxVelocity();
+    void updateSleeping();
+    void updateResolution();
+    bool isSurfaceParticle(int i);
+    void computeCellDepth();
+    void mergeParticles(int i, int j);
+    bool splitParticle(int i, int axis);
+    void markRebalance(int i);
+    void updateTimeLevels();
+    inline bool isAwake(int i) const {
+        return _fState[i] == SLOT_ALIVE && (!_sleeping || !_fSleeping[i]);
+    }
+    inline bool isActive(int i) const {
+        return isAwake(i) && (!_localTimeStepping || isDue(i));
+    }
+    inline bool isDue(int i) const {
+        return (_activeLevel < 0 || _fTimeLevel[i] == _activeLevel) && _localStep % (1 << _fTimeLevel[i]) == 0;
+    }
+    inline bool isFrozen(Index j) const { return _localTimeStepping && !isActive(j); }
+    // pressure of a finer frozen neighbor was found for a shorter step, keep its impulse over the step of i
+    inline T frozenPressure(int i, Index j) const {
+        if (!isFrozen(j) || _fTimeLevel[j] >= _fTimeLevel[i])
+            return _fPressure[j];
+        return _fPressure[j] / (1 << (_fTimeLevel[i] - _fTimeLevel[j]));
+    }
 
+    void calibratePsi();
     void computePsi(int i);
     void computeDensity(int i);
     void computeAdvectionForces(int i);
@@ -110,17 +355,94 @@ private:
 
     void storeSumDijPj(int i);
     void computePressure(int i);
-    void computeError();
+    void mergeError(const DensityError<A>& error);
+    bool hasConverged(int l);
+
+    void prepareSolverTiles();
+    void buildSolverTiles();
+    void solveTiles();
+
+    void predictAdvectionDF();
+    void divergenceSolve();
+    void densitySolve();
+    void computeFactor(int i);
+    void correctVelocity(int i);
+
+    void viscositySolve();
+    void storeViscosityDiagonal(int i);
+    Vec3A multiplyViscosity(int i, const std::vector<Vec3>& x);
 
     void computePressureForces(int i);
     void updateVelocity(int i);
     void updatePosition(int i);
 
 
+    /*--------------------------------------------Particle pool-------------------------------------------------*/
+
+    void updatePool();
+    void retireParticle(int i);
+    int  spawnParticle(const Vec3f& position, const Vec3f& velocity);
+    void compactPool();
+    void moveParticle(int from, int to);
+
+
     /*---------------------------------------Surface reconstruction----------------------------------------------*/
 
-    void computeDistanceField(int i, const float radius);
+    void markBandCells();
+    void surfaceNodeRange(int cell, int d, int& first, int& last) const;
+    void updateSurfaceBand();
+    void updateSurfaceBricks();
+    void updateDirtyBlocks();
+    void markSurfaceBlocks(const Vec3& position);
+    Index buildSurfaceOctree();
+    bool refineOctreeCell(const OCTLEAF& cell, std::vector<Index>& neighbors);
+    void splatDistanceField(const T radius);
+    void splatParticle(int j, int zFirst, int zLast, const T radius);
+    void computeDistanceField(int i, const T radius);
+    T    distanceAt(const Vec3& node, const T radius);
+    T    distanceFromSums(const Vec3& node, const Vec3A& sumX, const A sumK) const;
+    void gatherDistanceField(const T radius);
+    void gatherBrick(int x0, int y0, int z0, const T radius);
     void generateIsoSurface();
+    void updateIsoSurface();
+
+    template<class S>
+    void extractSurface(S& extractor);
+
+    template<class S, class V>
+    void extractDenseSurface(S& extractor, const V* field);
+
+    template<class S>
+    void storeMesh(const S& extractor);
+
+    template<class F>
+    void forEachSurfaceNode(F f);
+
+    // nodes per side of the bricks evaluated together by the gather, candidates come from the cells
+    // around the brick box : 4 keeps the box close to the kernel sphere
+    static const int gatherBrickSize = 4;
+
+    // surface nodes are addressed by slot : node index of the dense field, or position in the brick pool
+    inline int surfaceNodes(int d) const { return (d == 0 ? _sGridHelper.resX() : d == 1 ? _sGridHelper.resY() : _sGridHelper.resZ()) + 1; }
+    inline int surfaceSlot(int x, int y, int z) const {
+        return _sparseSurface ? _sparseField.slot(x, y, z) : x + y * surfaceNodes(0) + z * surfaceNodes(0) * surfaceNodes(1);
+    }
+    inline T& surfaceValue(int slot) { return _sparseSurface ? _sparseField[slot] : _distanceField[slot]; }
+    inline void setSurfaceValue(int slot, T value) {
+        if (_quantizedSurface)
+            _quantizedField[slot] = (short)std::lround(clamp(value / (2.0f * _h), T(-1), T(1)) * 32767);
+        else
+            surfaceValue(slot) = value;
+    }
+    inline void copySurfaceValue(int from, int to) {
+        if (_quantizedSurface)
+            _quantizedField[to] = _quantizedField[from];
+        else
+            surfaceValue(to) = surfaceValue(from);
+    }
+    inline Vec3 surfaceNode(int slot, int x, int y, int z) const {
+        return _sparseSurface ? Vec3(x * _sGridHelper.cellSize(), y * _sGridHelper.cellSize(), z * _sGridHelper.cellSize()) : _sPosition[slot];
+    }
 
 
     /*----------------------------------------Debug / visualization-----------------------------------------------*/
@@ -128,42 +450,96 @@ private:
     void visualizeFluidDensity();
     void visualizeBoundaryDensity();
     void visualizeFluidNeighbors(int i);
-    void debugCrash(int i);
 
 
     /*-------------------------------------------Class members---------------------------------------------------*/
 
     // smooth kernels
-    CubicSpline  _pKernel;
-    SimpleKernel _sKernel;
+    CubicSpline<A>  _pKernel;
+    SimpleKernel<A> _sKernel;
 
     // fluid particles data
-    std::vector<Vec3f> _fPosition;
-    std::vector<Vec3f> _fVelocity;
-    std::vector<Real>  _fPressure;
-    std::vector<Real>  _fDensity;
+    std::vector<Vec3>  _fPosition;
+    std::vector<Vec3>  _fVelocity;
+    std::vector<T>     _fPressure;
+    std::vector<T>     _fDensity;
     std::vector<Vec3f> _fColor;
 
     // boundary particles data
-    std::vector<Vec3f> _bPosition;
+    std::vector<Vec3>  _bPosition;
+    std::vector<Vec3>  _bVelocity;
+    std::vector<BoundaryGroup<T>> _bGroups;
     std::vector<Vec3f> _bColor;
 
     // surface data
-    std::vector<Vec3f> _sPosition;
-    std::vector<Real>  _distanceField;
-    IsoSurface<Real>   _isoSurface;
+    std::vector<Vec3>  _sPosition;
+    std::vector<T>     _distanceField;
+    IsoSurface<T>      _isoSurface;
+    FlyingEdges<T>     _flyingEdges;
+    SurfaceNets<T>     _surfaceNets;
+    OctreeSurface<T>   _octreeSurface;
+    SurfaceExtraction  _surfaceExtraction = MARCHING_CUBES;
+
+    // mesh of the last extraction, owned by its backend
+    const POINT3D*      _meshVertices      = nullptr;
+    const unsigned int* _meshIndices       = nullptr;
+    Index               _meshVertexCount   = 0;
+    Index               _meshTriangleCount = 0;
+
+    // narrow band : distance field evaluated around the particle cells holding fluid, other nodes stay outside
+    bool _narrowBand = false;
+    int  _bandMargin = 0;               // particle cells of dilation beyond the kernel reach
+    std::vector<char>  _bandCells;      // particle cells of the band
+    std::vector<char>  _nodeInBand;     // surface nodes evaluated this frame
+    std::vector<Index> _bandNodes;      // same nodes as a list, reset to the outside value next frame
+
+    // splatting : particles scatter W and W (x_node - x_j) to the nodes in reach, z-slabs of nodes owned by one task
+    bool _surfaceSplatting = false;
+    std::vector<A>     _splatWeight;                // sum of W per node, zero between frames
+    std::vector<Vec3A> _splatOffset;                // sum of W (x_node - x_j) per node, zero between frames
+    std::vector< std::vector<Index> > _splatSlabs;  // alive particles of each particle grid layer along z
+
+    // sparse surface : distance field stored in 8^3 bricks around the band, dense field kept for small domains
+    bool _sparseSurface = false;
+    int  _denseNodes    = 1 << 18;      // node count under which the dense field is used
+    SparseField<T> _sparseField;
+
+    // quantized surface : distances stored as 16-bit fixed point over the band range [-2h, 2h], extracted by the short instantiations
+    bool _quantizedSurface = false;
+    std::vector<short> _quantizedField;
+    IsoSurface<short>  _isoSurface16;
+    FlyingEdges<short> _flyingEdges16;
+    SurfaceNets<short> _surfaceNets16;
+
+    // adaptive octree : leaves split where the field bends or the density varies, the field is only evaluated at their corners
+    int  _octreeCells            = 8;       // size in surface cells of the coarsest leaves
+    T    _octreeFieldTolerance   = 0.1f;    // departure of the field from linear over a leaf, relative to its size
+    T    _octreeDensityTolerance = 0.25f;   // spread of the particle densities over a leaf, relative to the rest density
+    std::vector<OCTLEAF> _octreeLeaves;
+    std::vector<int>     _nodeStamp;        // reconstruction which last evaluated each node
+    int                  _surfaceStamp = 0;
+
+    // temporal surface : distance field and mesh only rebuilt in the 8^3 node blocks reached by particles which moved
+    bool _temporalSurface  = false;
+    T    _surfaceTolerance = 0.0f;      // displacement leaving the field unchanged, 0.05 h when not set
+    std::vector<Vec3>  _fSurfaceRef;    // position of each fluid particle in the current field
+    std::vector<char>  _fSurfaceBuilt;  // particle taken into the current field
+    std::vector<Vec3>  _vacatedRefs;    // positions of the particles retired since the last update
+    std::vector<char>  _dirtyBlocks;    // blocks to evaluate and extract again
+    std::vector<Index> _dirtyList;      // same blocks as a list
+    int _surfaceBlocks[3] = { 0, 0, 0 };
 
     // temporary data
-    std::vector<Real>  _Psi;
-    std::vector<Vec3f> _Dii;
-    std::vector<Real>  _Aii;
-    std::vector<Vec3f> _sumDijPj;
-    std::vector<Vec3f> _Vadv;
-    std::vector<Real>  _Dadv;
-    std::vector<Real>  _Pl;
-    std::vector<Real>  _Dcorr;
-    std::vector<Vec3f> _Fadv;
-    std::vector<Vec3f> _Fp;
+    std::vector<T>     _Psi;
+    std::vector<Vec3>  _Dii;
+    std::vector<T>     _Aii;
+    std::vector<Vec3>  _sumDijPj;
+    std::vector<Vec3>  _Vadv;
+    std::vector<T>     _Dadv;
+    std::vector<T>     _Pl;
+    std::vector<T>     _Dcorr;
+    std::vector<Vec3>  _Fadv;
+    std::vector<Vec3>  _Fp;
 
     // neigboring structures
     GridHelper _pGridHelper;
@@ -173,6 +549,71 @@ private:
     std::vector< std::vector<Index> > _bGrid;
     std::vector< std::vector<Index> > _bNeighbors;
 
+    // quantized positions : cell + 16-bit offset, mirror of positions read by neighbor loops
+    bool _quantizedPositions = false;
+    std::vector<QuantizedPosition> _fQuantized;
+    std::vector<QuantizedPosition> _bQuantized;
+
+    // particle pool
+    int   _fluidCapacity    = 0;       // preallocated fluid slots
+    int   _aliveCount       = 0;       // fluid particles alive, _fluidCount is the highest slot in use + 1
+    T     _maxFragmentation = 0.25f;   // ratio of free slots triggering a compaction
+    std::vector<char>        _fState;    // SlotState of each fluid slot
+    std::vector<Index>       _freeSlots; // free slots under _fluidCount
+    std::vector<FluidVolume> _emitters;
+    std::vector<FluidVolume> _sinks;
+
+    // sleeping particles
+    bool _sleeping      = false;    // freeze particles at rest
+    T    _sleepVelocity = 0.01f;    // speed under which a particle is at rest
+    T    _sleepDensity  = 0.01f;    // relative density error under which a particle is at rest
+    int  _sleepSteps    = 30;       // steps at rest before falling asleep
+    std::vector<char> _fSleeping;   // frozen particles, their fields are reused
+    std::vector<int>  _fRestSteps;  // consecutive steps spent at rest
+    std::vector<char> _activeCells; // cells holding a moving particle, they wake their neighbor cells
+
+    // adaptive resolution : level L particles weigh 2^L rest masses, deep fluid merges and surface fluid splits
+    bool _adaptiveResolution = false;
+    int  _maxLevel   = 3;           // heaviest level, smoothing length grows as the cube root of the mass
+    int  _fineDepth  = 2;           // cells under the surface and walls kept at rest resolution
+    int  _levelInUse = 0;           // heaviest level among alive particles
+    int  _splitAxis  = 0;           // axis of the next splits, alternates every update
+    T    _blendDecay = 0.95f;       // per step fading of the density shifts
+    std::vector<T>    _fMass;           // particle masses
+    std::vector<T>    _fSpacing;        // particle smoothing lengths
+    std::vector<char> _fLevel;          // particle resolution levels
+    std::vector<T>    _fDensityShift;   // kernel sum jump of merges and splits still hidden from the solver
+    std::vector<char> _fRebalance;      // density shift to capture at the next density computation
+    std::vector<char> _cellDepth;       // distance in cells from the free surface or a wall
+
+    // coarse boundary sampling : domain walls sampled at their own spacing, Psi from the full kernel support
+    T _boundarySpacing = 0.0f;          // spacing of the domain wall samples, 0 for half a grid cell
+    T _psiCalibration  = 1.0f;          // full-support Psi matching the default one on a flat wall
+
+    // periodic boundaries : wrapped positions, neighbor cells and offsets along the chosen axes
+    Vec3i _periodicAxes       = Vec3i(0, 0, 0);
+    bool  _periodicBoundaries = false;
+
+    // implicit boundaries : static walls baked into node maps of boundary volume, volume gradient and samples within 2h
+    bool  _implicitBoundaries = false;
+    T     _mapSpacing = 0.0f;           // node spacing of the maps, a quarter of the particle spacing by default
+    GridHelper _mGridHelper;            // map cells covering the particle grid
+    Vec3i _mapRes;                      // number of nodes along each axis
+    std::vector<T>    _mapDistance;     // distance to the closest wall shell, negative inside it, 1.5h far from walls
+    std::vector<T>    _mapVolume;       // sum of Psi_b W_ib over static walls
+    std::vector<Vec3> _mapGradient;     // sum of Psi_b gradW_ib over static walls
+    std::vector<T>    _mapCount;        // static samples in reach, keeps surface detection unchanged
+    std::vector<char> _wallCells;       // particle grid cells holding static samples
+    std::vector<T>    _fWallVolume;     // map values at the fluid particles, sampled with the neighbor search
+    std::vector<Vec3> _fWallGradient;
+    std::vector<T>    _fWallCount;
+
+    // cache-blocked pressure solve
+    std::vector< std::vector<Index> > _tiles;       // fluid particles of each tile
+    std::vector< std::vector<int> >   _tileColors;  // tiles sharing the same parity
+    Vec3i _tileRes;                                 // number of tiles along each axis
+    int   _tileSize = 1;                            // tile edge in particle grid cells
+
     // visualization
     Vec3f _wallColor  = { 195 / 255.0f,  50 / 255.0f,  30 / 255.0f };
     Vec3f _lightColor = {  79 / 255.0f, 132 / 255.0f, 237 / 255.0f };
@@ -183,30 +624,88 @@ private:
 
 
     // simulation
-    int  _fluidCount      = 0;      // total number of fluid particles
+    int  _fluidCount      = 0;      // number of fluid slots in use
     int  _inBoundaryCount = 0;      // numer of inner boundary particles
     int  _boundaryCount   = 0;      // total number of boundary particles
     int  _surfaceCount    = 0;      // number of surface nodes
-    Real _avgDensity      = 0.0f;   // average density of fluid
+    T    _avgDensity      = 0.0f;   // average density of fluid
+    DensityError<A> _error;         // density error of the last Jacobi iteration
+
+    // divergence-free solver, factors are stored in _Aii and stiffness of the current iteration in _Pl
+    SolverMode     _solverMode = IISPH_SOLVER;
+    std::vector<T> _kappa;      // accumulated density stiffness, warm start of the next step
+    std::vector<T> _kappaV;     // accumulated divergence stiffness, warm start of the next step
+
+    // implicit viscosity, (V - dt * nu * L) v = V v* solved by preconditioned CG with V the particle volumes
+    bool _implicitViscosity      = false;   // replaces the explicit viscous force
+    T    _viscosityTolerance     = 0.01f;   // residual relative to the right-hand side ending the solve
+    int  _maxViscosityIterations = 100;     // CG iterations never exceeded
+    std::vector<Vec3> _Vvisc;               // viscous velocity change of the last step, warm start of the next one
+    std::vector<Vec3> _viscDiagonal;        // Jacobi preconditioner
+    std::vector<Vec3> _viscResidual;
+    std::vector<Vec3> _viscDirection;
+    std::vector<Vec3> _viscProduct;         // system times search direction
+
+    // pressure solve
+    bool   _tiledSolve      = false;    // solve pressure tile by tile
+    int    _localIterations = 2;        // Jacobi sweeps per tile between halo exchanges
+    size_t _cacheSize       = 1 << 20;  // cache budget of a tile and its halo (bytes)
+    int    _minIterations   = 2;        // Jacobi iterations always performed
+    int    _maxIterations   = 100;      // Jacobi iterations never exceeded
+    ToleranceMode _toleranceMode = AVERAGE_ERROR;
+    int    _lastIterations  = 0;        // Jacobi iterations of the last step
+
+    // time stepping
+    bool _adaptiveTimeStep = false;     // time step driven by the CFL condition
+    T    _cfl              = 0.4f;      // CFL number
+    T    _dtMin            = 1e-4f;     // smallest time step allowed
+    T    _dtMax            = 1.0f / 60; // largest time step allowed
+    int  _iterationBudget  = 10;        // Jacobi iterations targeted per step
+    T    _dtScale          = 1.0f;      // shrinks the CFL step when the solver struggles
+
+    // local time stepping : level k cells are solved every 2^k substeps with 2^k times the step, all positions drift every substep
+    bool _localTimeStepping = false;
+    int  _maxTimeLevel      = 2;        // coarsest time level
+    int  _localStep         = 0;        // substep inside the current 2^_maxTimeLevel cycle
+    int  _activeLevel       = -1;       // level being solved, -1 for every level due
+    std::vector<char> _fTimeLevel;      // time level of each fluid particle
+    std::vector<char> _cellTimeLevel;   // time level of each grid cell from its local CFL limit
+    std::vector<int>  _levelCount;      // particles due at each level in the current substep
 
     // SPH coefficients
-    Real  _dtCFL;                 // time step from CFL condition
-    Real  _dt;                    // time step
-    Real  _nu;                    // kinematic viscosity
-    Real  _eta;                   // compressibility
-    Real  _rho0;                  // rest density
-    Real  _h;                     // particle spacing
-    Vec3f _g;                     // gravity
-    Real  _m0;                    // rest mass
-    Real  _omega;                 // Jacobi's relaxed coeff
-    Real  _c;                     // speed of sound
+    T     _dtCFL;                 // time step from CFL condition
+    T     _dt;                    // time step
+    T     _nu;                    // kinematic viscosity
+    T     _eta;                   // compressibility
+    T     _maxEta;                // maximum compressibility, same units as eta
+    T     _rho0;                  // rest density
+    T     _h;                     // particle spacing
+    Vec3  _g;                     // gravity
+    T     _m0;                    // rest mass
+    T     _omega;                 // Jacobi's relaxed coeff
+    T     _c;                     // speed of sound
 
     // statistics
     double searchNeighborsTime  = 0.0f;
     double predictAdvectionTime = 0.0f;
     double solvePressureTime    = 0.0f;
     double correctPositionTime  = 0.0f;
+    double pressureIterations   = 0.0f;
+    double compressedParticles  = 0.0f;
+    double divergenceIterations = 0.0f;
+    double viscosityIterations  = 0.0f;
+    double substepsPerFrame     = 1.0f;
+    double sleepingParticles    = 0.0f;
+    double mergedParticles      = 0.0f;
+    double splitParticles       = 0.0f;
+    double steppedParticles     = 1.0f;
+    double bandNodes            = 1.0f;
+    double surfaceMemory        = 0.0f;
+    double dirtyBlocks          = 1.0f;
     double distanceFieldTime    = 0.0f;
     double marchingCubesTime    = 0.0f;
 };
 
+typedef IISPHsolver3D<float>         IISPHsolver3Df;   // single precision
+typedef IISPHsolver3D<float, double> IISPHsolver3Dm;   // float storage, double accumulation
+typedef IISPHsolver3D<double>        IISPHsolver3Dd;   // double precision, for validation runs
@@ -12,9 +12,9 @@
 typedef float Real;
 typedef long int Index;
 
-inline Real square(const Real a) { return a*a; }
-inline Real cube(const Real a) { return a*a*a; }
-inline Real clamp(const Real v, const Real vmin, const Real vmax)
+template<typename T> inline T square(const T a) { return a*a; }
+template<typename T> inline T cube(const T a) { return a*a*a; }
+template<typename T> inline T clamp(const T v, const T vmin, const T vmax)
 {
   if(v<vmin) return vmin;
   if(v>vmax) return vmax;
@@ -292,7 +292,7 @@ public:
     Vector3 normalized() const { return Vector3(*this).normalize(); }
 
     T dotProduct(const Vector3& r) const { return x * r.x + y * r.y + z * r.z; }
-    T crossProduct(const Vector3& r) const { return x * r.y - y * r.x; } // incomplete
+    Vector3 crossProduct(const Vector3& r) const { return Vector3(y * r.z - z * r.y, z * r.x - x * r.z, x * r.y - y * r.x); }
 
     T length() const { return std::sqrt(lengthSquare()); }
     T lengthSquare() const { return x * x + y * y + z * z; }
@@ -357,5 +357,5 @@ public:
 typedef Vector3<Real> Vec3f;
 typedef Vector3<int> Vec3i;
 
-inline const Vec3i operator*(const Real s, const Vec3i& r) { return r * s; }
-inline const Vec3f operator*(const Real s, const Vec3f& r) { return r * s; }
+template<typename T>
+inline const Vector3<T> operator*(const typename Vector3<T>::ValueT s, const Vector3<T>& r) { return r * s; }
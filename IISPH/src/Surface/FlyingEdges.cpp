@@ -0,0 +1,349 @@
+// Description: This is the implementation file for the FlyingEdges
+// class. Cases and triangles come from the tables of IsoSurface, with
+// the same edge numbering.
+
+#include "FlyingEdges.h"
+
+template <class T> FlyingEdges<T>::FlyingEdges()
+{
+	m_fCellLengthX = 0;
+	m_fCellLengthY = 0;
+	m_fCellLengthZ = 0;
+	m_nCellsX = 0;
+	m_nCellsY = 0;
+	m_nCellsZ = 0;
+	m_nTriangles = 0;
+	m_nVertices = 0;
+	m_ppt3dVertices = NULL;
+	m_piTriangleIndices = NULL;
+	m_ptScalarField = NULL;
+	m_pSparseField = NULL;
+	m_tIsoLevel = 0;
+	m_bValidSurface = false;
+}
+
+template <class T> FlyingEdges<T>::~FlyingEdges()
+{
+	DeleteSurface();
+}
+
+template <class T> void FlyingEdges<T>::GenerateSurface(const T* ptScalarField, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ)
+{
+	if (m_bValidSurface)
+		DeleteSurface();
+
+	m_tIsoLevel = tIsoLevel;
+	m_nCellsX   = nCellsX;
+	m_nCellsY   = nCellsY;
+	m_nCellsZ   = nCellsZ;
+	m_fCellLengthX  = fCellLengthX;
+	m_fCellLengthY  = fCellLengthY;
+	m_fCellLengthZ  = fCellLengthZ;
+	m_ptScalarField = ptScalarField;
+	m_pSparseField  = NULL;
+
+	FlyEdges();
+}
+
+template <class T> void FlyingEdges<T>::GenerateSurface(const SparseField<T>& sparseField, T tIsoLevel, float fCellLengthX, float fCellLengthY, float fCellLengthZ)
+{
+	if (m_bValidSurface)
+		DeleteSurface();
+
+	m_tIsoLevel = tIsoLevel;
+	m_nCellsX   = sparseField.nodes(0) - 1;
+	m_nCellsY   = sparseField.nodes(1) - 1;
+	m_nCellsZ   = sparseField.nodes(2) - 1;
+	m_fCellLengthX  = fCellLengthX;
+	m_fCellLengthY  = fCellLengthY;
+	m_fCellLengthZ  = fCellLengthZ;
+	m_ptScalarField = NULL;
+	m_pSparseField  = &sparseField;
+
+	FlyEdges();
+}
+
+template <class T> bool FlyingEdges<T>::IsSurfaceValid()
+{
+	return m_bValidSurface;
+}
+
+template <class T> void FlyingEdges<T>::DeleteSurface()
+{
+	m_fCellLengthX = 0;
+	m_fCellLengthY = 0;
+	m_fCellLengthZ = 0;
+	m_nCellsX = 0;
+	m_nCellsY = 0;
+	m_nCellsZ = 0;
+	m_nTriangles = 0;
+	m_nVertices = 0;
+	if (m_ppt3dVertices != NULL) {
+		delete[] m_ppt3dVertices;
+		m_ppt3dVertices = NULL;
+	}
+	if (m_piTriangleIndices != NULL) {
+		delete[] m_piTriangleIndices;
+		m_piTriangleIndices = NULL;
+	}
+
+	m_ptScalarField = NULL;
+	m_pSparseField = NULL;
+	m_tIsoLevel = 0;
+	m_bValidSurface = false;
+}
+
+template <class T> void FlyingEdges<T>::FlyEdges()
+{
+	int nRows = (m_nCellsY + 1)*(m_nCellsZ + 1);
+	m_edgeCases.resize((size_t)nRows*m_nCellsX);
+	m_rows.resize(nRows);
+
+	// Pass 1 : x-edges of every row.
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int r = 0; r < nRows; r++)
+		ClassifyRow(r % (m_nCellsY + 1), r / (m_nCellsY + 1));
+
+	// Pass 2 : y- and z-edges, triangles.
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int r = 0; r < nRows; r++)
+		CountRow(r % (m_nCellsY + 1), r / (m_nCellsY + 1));
+
+	// Pass 3 : prefix sum over the rows. The vertices of a row are its
+	// x-, then y-, then z-edge intersections.
+	m_nVertices = 0;
+	m_nTriangles = 0;
+	for (ROW& row : m_rows) {
+		unsigned int xInts = row.xInts, yInts = row.yInts, zInts = row.zInts, nTriangles = row.nTriangles;
+		row.xInts = m_nVertices;
+		row.yInts = row.xInts + xInts;
+		row.zInts = row.yInts + yInts;
+		row.nTriangles = m_nTriangles;
+		m_nVertices = row.zInts + zInts;
+		m_nTriangles += nTriangles;
+	}
+
+	m_ppt3dVertices = new POINT3D[m_nVertices];
+	m_piTriangleIndices = new unsigned int[m_nTriangles*3];
+
+	// Pass 4 : output.
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int r = 0; r < nRows; r++) {
+		GenerateVertices(r % (m_nCellsY + 1), r / (m_nCellsY + 1));
+		GenerateTriangles(r % (m_nCellsY + 1), r / (m_nCellsY + 1));
+	}
+
+	m_bValidSurface = true;
+}
+
+template <class T> void FlyingEdges<T>::ClassifyRow(unsigned int nY, unsigned int nZ)
+{
+	unsigned int nRow = RowID(nY, nZ);
+	unsigned char* cases = &m_edgeCases[nRow*m_nCellsX];
+	ROW& row = m_rows[nRow];
+
+	row.xInts = 0;
+	row.xL = m_nCellsX;
+	row.xR = 0;
+
+	unsigned char below = Sample(0, nY, nZ) < m_tIsoLevel;
+
+	for (unsigned int x = 0; x < m_nCellsX; x++) {
+		// A brick row touching no brick only holds the background
+		if (m_pSparseField && (x % SparseField<T>::brickSize) == 0 && m_pSparseField->emptyRun(x, nY, nZ)) {
+			unsigned int last = std::min(x + SparseField<T>::brickSize, m_nCellsX);
+			std::fill(cases + x, cases + last, 0);
+			below = 0;
+			x = last - 1;
+			continue;
+		}
+
+		unsigned char next = Sample(x + 1, nY, nZ) < m_tIsoLevel;
+		cases[x] = below | next << 1;
+
+		if (below != next) {
+			row.xInts++;
+			row.xL = std::min(row.xL, x);
+			row.xR = x + 1;
+		}
+		below = next;
+	}
+}
+
+template <class T> void FlyingEdges<T>::TrimRows(const unsigned int* pRows, int nRows, unsigned int& xL, unsigned int& xR) const
+{
+	xL = m_nCellsX;
+	xR = 0;
+
+	// Left of its first crossing a row holds the value of its first
+	// point, right of its last crossing the value of its last point. The
+	// rows only cross each other there if these values differ.
+	for (int k = 0; k < nRows; k++) {
+		xL = std::min(xL, m_rows[pRows[k]].xL);
+		xR = std::max(xR, m_rows[pRows[k]].xR);
+	}
+
+	const unsigned char* first = EdgeCases(pRows[0]);
+	for (int k = 1; k < nRows; k++) {
+		const unsigned char* cases = EdgeCases(pRows[k]);
+		if (Below(cases, 0) != Below(first, 0))
+			xL = 0;
+		if (Below(cases, m_nCellsX) != Below(first, m_nCellsX))
+			xR = m_nCellsX;
+	}
+}
+
+template <class T> void FlyingEdges<T>::CountRow(unsigned int nY, unsigned int nZ)
+{
+	ROW& row = m_rows[RowID(nY, nZ)];
+	const unsigned char* cases = EdgeCases(RowID(nY, nZ));
+	unsigned int xL, xR;
+
+	row.yInts = 0;
+	row.zInts = 0;
+	row.nTriangles = 0;
+
+	// y-edges towards the next row
+	if (nY < m_nCellsY) {
+		unsigned int rows[2] = { RowID(nY, nZ), RowID(nY + 1, nZ) };
+		const unsigned char* above = EdgeCases(rows[1]);
+		TrimRows(rows, 2, xL, xR);
+
+		for (unsigned int x = xL; x <= xR && xL < xR; x++)
+			row.yInts += Below(cases, x) != Below(above, x);
+	}
+
+	// z-edges towards the next plane
+	if (nZ < m_nCellsZ) {
+		unsigned int rows[2] = { RowID(nY, nZ), RowID(nY, nZ + 1) };
+		const unsigned char* above = EdgeCases(rows[1]);
+		TrimRows(rows, 2, xL, xR);
+
+		for (unsigned int x = xL; x <= xR && xL < xR; x++)
+			row.zInts += Below(cases, x) != Below(above, x);
+	}
+
+	// cells between the row and the three next ones
+	if (nY < m_nCellsY && nZ < m_nCellsZ) {
+		unsigned int rows[4] = { RowID(nY, nZ), RowID(nY + 1, nZ), RowID(nY, nZ + 1), RowID(nY + 1, nZ + 1) };
+		const unsigned char* e0 = EdgeCases(rows[0]);
+		const unsigned char* e1 = EdgeCases(rows[1]);
+		const unsigned char* e2 = EdgeCases(rows[2]);
+		const unsigned char* e3 = EdgeCases(rows[3]);
+		TrimRows(rows, 4, xL, xR);
+
+		for (unsigned int x = xL; x < xR; x++) {
+			unsigned int tableIndex =
+				(e0[x] & 1) | (e1[x] & 1) << 1 | (e1[x] >> 1) << 2 | (e0[x] >> 1) << 3 |
+				(e2[x] & 1) << 4 | (e3[x] & 1) << 5 | (e3[x] >> 1) << 6 | (e2[x] >> 1) << 7;
+
+			for (int i = 0; IsoSurface<T>::m_triTable[tableIndex][i] != -1; i += 3)
+				row.nTriangles++;
+		}
+	}
+}
+
+template <class T> void FlyingEdges<T>::GenerateVertices(unsigned int nY, unsigned int nZ)
+{
+	const ROW& row = m_rows[RowID(nY, nZ)];
+	const unsigned char* cases = EdgeCases(RowID(nY, nZ));
+	unsigned int xL, xR;
+
+	// Same interpolation directions as the edges 3, 0 and 8 of IsoSurface
+	unsigned int id = row.xInts;
+	for (unsigned int x = row.xL; x < row.xR; x++)
+		if (cases[x] == 1 || cases[x] == 2)
+			Interpolate(m_ppt3dVertices[id++], x + 1, nY, nZ, x, nY, nZ);
+
+	if (nY < m_nCellsY) {
+		unsigned int rows[2] = { RowID(nY, nZ), RowID(nY + 1, nZ) };
+		const unsigned char* above = EdgeCases(rows[1]);
+		TrimRows(rows, 2, xL, xR);
+
+		id = row.yInts;
+		for (unsigned int x = xL; x <= xR && xL < xR; x++)
+			if (Below(cases, x) != Below(above, x))
+				Interpolate(m_ppt3dVertices[id++], x, nY, nZ, x, nY + 1, nZ);
+	}
+
+	if (nZ < m_nCellsZ) {
+		unsigned int rows[2] = { RowID(nY, nZ), RowID(nY, nZ + 1) };
+		const unsigned char* above = EdgeCases(rows[1]);
+		TrimRows(rows, 2, xL, xR);
+
+		id = row.zInts;
+		for (unsigned int x = xL; x <= xR && xL < xR; x++)
+			if (Below(cases, x) != Below(above, x))
+				Interpolate(m_ppt3dVertices[id++], x, nY, nZ, x, nY, nZ + 1);
+	}
+}
+
+template <class T> void FlyingEdges<T>::GenerateTriangles(unsigned int nY, unsigned int nZ)
+{
+	if (nY == m_nCellsY || nZ == m_nCellsZ)
+		return;
+
+	unsigned int rows[4] = { RowID(nY, nZ), RowID(nY + 1, nZ), RowID(nY, nZ + 1), RowID(nY + 1, nZ + 1) };
+	const unsigned char* e0 = EdgeCases(rows[0]);
+	const unsigned char* e1 = EdgeCases(rows[1]);
+	const unsigned char* e2 = EdgeCases(rows[2]);
+	const unsigned char* e3 = EdgeCases(rows[3]);
+	unsigned int xL, xR;
+	TrimRows(rows, 4, xL, xR);
+
+	// Running vertex IDs of the edges of the current cell. No edge of
+	// these rows crosses the isolevel before xL, so they start at the
+	// row offsets.
+	unsigned int xIds[4] = { m_rows[rows[0]].xInts, m_rows[rows[1]].xInts, m_rows[rows[2]].xInts, m_rows[rows[3]].xInts };
+	unsigned int yIds[2] = { m_rows[rows[0]].yInts, m_rows[rows[2]].yInts };
+	unsigned int zIds[2] = { m_rows[rows[0]].zInts, m_rows[rows[1]].zInts };
+	unsigned int* indices = m_piTriangleIndices + 3*m_rows[rows[0]].nTriangles;
+
+	for (unsigned int x = xL; x < xR; x++) {
+		unsigned int tableIndex =
+			(e0[x] & 1) | (e1[x] & 1) << 1 | (e1[x] >> 1) << 2 | (e0[x] >> 1) << 3 |
+			(e2[x] & 1) << 4 | (e3[x] & 1) << 5 | (e3[x] >> 1) << 6 | (e2[x] >> 1) << 7;
+
+		// Crossings of the y- and z-edges on the left face of the cell
+		unsigned int y0 = (e0[x] & 1) != (e1[x] & 1), y1 = (e2[x] & 1) != (e3[x] & 1);
+		unsigned int z0 = (e0[x] & 1) != (e2[x] & 1), z1 = (e1[x] & 1) != (e3[x] & 1);
+
+		if (IsoSurface<T>::m_edgeTable[tableIndex] != 0) {
+			unsigned int edgeIds[12] = {
+				yIds[0], xIds[1], yIds[0] + y0, xIds[0],
+				yIds[1], xIds[3], yIds[1] + y1, xIds[2],
+				zIds[0], zIds[1], zIds[1] + z1, zIds[0] + z0
+			};
+
+			for (int i = 0; IsoSurface<T>::m_triTable[tableIndex][i] != -1; i++)
+				*indices++ = edgeIds[IsoSurface<T>::m_triTable[tableIndex][i]];
+		}
+
+		xIds[0] += e0[x] == 1 || e0[x] == 2;
+		xIds[1] += e1[x] == 1 || e1[x] == 2;
+		xIds[2] += e2[x] == 1 || e2[x] == 2;
+		xIds[3] += e3[x] == 1 || e3[x] == 2;
+		yIds[0] += y0;
+		yIds[1] += y1;
+		zIds[0] += z0;
+		zIds[1] += z1;
+	}
+}
+
+template <class T> void FlyingEdges<T>::Interpolate(POINT3D& pt, unsigned int nX1, unsigned int nY1, unsigned int nZ1, unsigned int nX2, unsigned int nY2, unsigned int nZ2)
+{
+	float x1 = nX1*m_fCellLengthX, y1 = nY1*m_fCellLengthY, z1 = nZ1*m_fCellLengthZ;
+	float x2 = nX2*m_fCellLengthX, y2 = nY2*m_fCellLengthY, z2 = nZ2*m_fCellLengthZ;
+	T tVal1 = Sample(nX1, nY1, nZ1);
+	T tVal2 = Sample(nX2, nY2, nZ2);
+
+	float mu = float((m_tIsoLevel - tVal1))/(tVal2 - tVal1);
+	pt[0] = x1 + mu*(x2 - x1);
+	pt[1] = y1 + mu*(y2 - y1);
+	pt[2] = z1 + mu*(z2 - z1);
+}
+
+template class FlyingEdges<short>;
+template class FlyingEdges<unsigned short>;
+template class FlyingEdges<float>;
+template class FlyingEdges<double>;
@@ -0,0 +1,131 @@
+# pragma once
+// Description: Flying Edges isosurface extraction (Schroeder, Maynard
+// and Geveci, 2015). Same outputs as IsoSurface, built edge by edge in
+// four passes parallel over the grid rows along x :
+//  1. classify the x-edges of each row and trim the row to the span
+//     where they cross the isolevel,
+//  2. count the y- and z-edge intersections and the triangles of each
+//     row inside the trimmed spans,
+//  3. turn the counts into output offsets with a prefix sum,
+//  4. write vertices and triangles directly into the output arrays.
+
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "Vectors.h"
+#include "SparseField.h"
+#include "IsoSurface.h"
+
+template <class T> class FlyingEdges {
+public:
+	// Constructor and destructor.
+	FlyingEdges();
+	~FlyingEdges();
+
+	// Generates the isosurface from the scalar field contained in the
+	// buffer ptScalarField[].
+	void GenerateSurface(const T* ptScalarField, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
+
+	// Same from a field stored in bricks, rows running through missing
+	// bricks are classified without sampling. The background must lie
+	// above the isolevel.
+	void GenerateSurface(const SparseField<T>& sparseField, T tIsoLevel, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
+
+	// Returns true if a valid surface has been generated.
+	bool IsSurfaceValid();
+
+	// Deletes the isosurface.
+	void DeleteSurface();
+
+
+
+	/*-----------------------------Output values to be used-----------------------------*/
+
+	// The number of vertices which make up the isosurface.
+	unsigned int m_nVertices;
+
+	// The vertices which make up the isosurface.
+	POINT3D* m_ppt3dVertices;
+
+	// The number of triangles which make up the isosurface.
+	unsigned int m_nTriangles;
+
+	// The indices of the vertices which make up the triangles.
+	unsigned int* m_piTriangleIndices;
+
+
+
+private:
+	/*-----------------------Private class member and functions-----------------------*/
+
+	// Intersections and triangles of a row along x, counts after pass 2
+	// and output offsets after pass 3. Crossing x-edges lie in [xL, xR).
+	struct ROW {
+		unsigned int xInts, yInts, zInts, nTriangles;
+		unsigned int xL, xR;
+	};
+
+	// Runs the four passes over the field set up by GenerateSurface.
+	void FlyEdges();
+
+	// Pass 1 : classifies the x-edges of a row and trims it.
+	void ClassifyRow(unsigned int nY, unsigned int nZ);
+
+	// Span of points [xL, xR] of a group of rows outside of which no edge
+	// between them crosses the isolevel. Empty when xL >= xR.
+	void TrimRows(const unsigned int* pRows, int nRows, unsigned int& xL, unsigned int& xR) const;
+
+	// Pass 2 : counts the y- and z-edge intersections and the triangles
+	// of a row.
+	void CountRow(unsigned int nY, unsigned int nZ);
+
+	// Pass 4 : vertices on the edges of a row, triangles of its cells.
+	void GenerateVertices(unsigned int nY, unsigned int nZ);
+	void GenerateTriangles(unsigned int nY, unsigned int nZ);
+
+	// Interpolates the intersection with an edge from grid point 1 to
+	// grid point 2, as IsoSurface does.
+	void Interpolate(POINT3D& pt, unsigned int nX1, unsigned int nY1, unsigned int nZ1, unsigned int nX2, unsigned int nY2, unsigned int nZ2);
+
+	// Returns the field value at a grid point.
+	inline T Sample(unsigned int nX, unsigned int nY, unsigned int nZ) const {
+		if (m_pSparseField)
+			return m_pSparseField->value(nX, nY, nZ);
+		return m_ptScalarField[(nZ * (m_nCellsY + 1) + nY) * (m_nCellsX + 1) + nX];
+	}
+
+	// Row index and x-edge cases of a row. The case of an x-edge holds
+	// whether its first point is below the isolevel in bit 0 and its
+	// second point in bit 1.
+	inline unsigned int RowID(unsigned int nY, unsigned int nZ) const { return nZ * (m_nCellsY + 1) + nY; }
+	inline const unsigned char* EdgeCases(unsigned int nRow) const { return &m_edgeCases[nRow * m_nCellsX]; }
+
+	// True when grid point nX of a row lies below the isolevel.
+	inline bool Below(const unsigned char* pCases, unsigned int nX) const {
+		return nX < m_nCellsX ? (pCases[nX] & 1) : (pCases[m_nCellsX - 1] >> 1);
+	}
+
+	// No. of cells in x, y, and z directions.
+	unsigned int m_nCellsX, m_nCellsY, m_nCellsZ;
+
+	// Cell length in x, y, and z directions.
+	float m_fCellLengthX, m_fCellLengthY, m_fCellLengthZ;
+
+	// The buffer holding the scalar field.
+	const T* m_ptScalarField;
+
+	// The bricks holding the scalar field, NULL for a dense buffer.
+	const SparseField<T>* m_pSparseField;
+
+	// The isosurface value.
+	T m_tIsoLevel;
+
+	// Indicates whether a valid surface is present.
+	bool m_bValidSurface;
+
+	// Cases of the x-edges, m_nCellsX per row.
+	std::vector<unsigned char> m_edgeCases;
+
+	// Rows along x, (m_nCellsY + 1) per plane.
+	std::vector<ROW> m_rows;
+};
@@ -316,8 +316,10 @@ template <class T> IsoSurface<T>::IsoSurface()
 	m_ppt3dVertices = NULL;
 	m_piTriangleIndices = NULL;
 	m_ptScalarField = NULL;
+	m_pSparseField = NULL;
 	m_tIsoLevel = 0;
 	m_bValidSurface = false;
+	m_nChunkCells[0] = m_nChunkCells[1] = m_nChunkCells[2] = 0;
 }
 
 template <class T> IsoSurface<T>::~IsoSurface()
@@ -338,126 +340,314 @@ template <class T> void IsoSurface<T>::GenerateSurface(const T* ptScalarField, T
 	m_fCellLengthY  = fCellLengthY;
 	m_fCellLengthZ  = fCellLengthZ;
 	m_ptScalarField = ptScalarField;
+	m_pSparseField  = NULL;
 
+	MarchCubes();
+}
+
+template <class T> void IsoSurface<T>::GenerateSurface(const SparseField<T>& sparseField, T tIsoLevel, float fCellLengthX, float fCellLengthY, float fCellLengthZ)
+{
+	if (m_bValidSurface)
+		DeleteSurface();
+
+	m_tIsoLevel = tIsoLevel;
+	m_nCellsX   = sparseField.nodes(0) - 1;
+	m_nCellsY   = sparseField.nodes(1) - 1;
+	m_nCellsZ   = sparseField.nodes(2) - 1;
+	m_fCellLengthX  = fCellLengthX;
+	m_fCellLengthY  = fCellLengthY;
+	m_fCellLengthZ  = fCellLengthZ;
+	m_ptScalarField = NULL;
+	m_pSparseField  = &sparseField;
+
+	MarchCubes();
+}
+
+template <class T> void IsoSurface<T>::MarchCubes()
+{
 	unsigned int nPointsInXDirection = (m_nCellsX + 1);
 	unsigned int nPointsInSlice = nPointsInXDirection*(m_nCellsY + 1);
+	unsigned int nPlanes = m_nCellsZ + 1;
 
-	// Generate isosurface
-	for (int z = 0; z < m_nCellsZ; z++) {
-		for (int y = 0; y < m_nCellsY; y++) {
-			for (int x = 0; x < m_nCellsX; x++) {
-				// Calculate table lookup index from those vertices which are below the isolevel
-				unsigned int tableIndex = 0;
-				if (m_ptScalarField[z * nPointsInSlice + y * nPointsInXDirection + x] < m_tIsoLevel)
-					tableIndex |= 1;
-				if (m_ptScalarField[z * nPointsInSlice + (y + 1) * nPointsInXDirection + x] < m_tIsoLevel)
-					tableIndex |= 2;
-				if (m_ptScalarField[z * nPointsInSlice + (y + 1) * nPointsInXDirection + (x + 1)] < m_tIsoLevel)
-					tableIndex |= 4;
-				if (m_ptScalarField[z * nPointsInSlice + y * nPointsInXDirection + (x + 1)] < m_tIsoLevel)
-					tableIndex |= 8;
-				if (m_ptScalarField[(z + 1) * nPointsInSlice + y * nPointsInXDirection + x] < m_tIsoLevel)
-					tableIndex |= 16;
-				if (m_ptScalarField[(z + 1) * nPointsInSlice + (y + 1) * nPointsInXDirection + x] < m_tIsoLevel)
-					tableIndex |= 32;
-				if (m_ptScalarField[(z + 1) * nPointsInSlice + (y + 1) * nPointsInXDirection + (x + 1)] < m_tIsoLevel)
-					tableIndex |= 64;
-				if (m_ptScalarField[(z + 1) * nPointsInSlice + y * nPointsInXDirection + (x + 1)] < m_tIsoLevel)
-					tableIndex |= 128;
-
-				// Now create a triangulation of the isosurface in this cell
-				if (m_edgeTable[tableIndex] != 0) {
-					if (m_edgeTable[tableIndex] & 8) {
-						POINT3DID pt = CalculateIntersection(x, y, z, 3);
-						unsigned int id = GetEdgeID(x, y, z, 3);
-						m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-					}
-					if (m_edgeTable[tableIndex] & 1) {
-						POINT3DID pt = CalculateIntersection(x, y, z, 0);
-						unsigned int id = GetEdgeID(x, y, z, 0);
-						m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-					}
-					if (m_edgeTable[tableIndex] & 256) {
-						POINT3DID pt = CalculateIntersection(x, y, z, 8);
-						unsigned int id = GetEdgeID(x, y, z, 8);
-						m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-					}
+	// Slabs of point planes along z, a few per thread so that empty ones
+	// do not stall the others. A slab owns the edges leaving its points
+	// and the cells above them.
+	int nSlabs = std::min((int)nPlanes, 4*omp_get_max_threads());
+	m_chunks.clear();
+	m_slabs.resize(nSlabs);
+	m_edgeVertex.resize(3*nPointsInSlice*nPlanes);
 
-					if (x == m_nCellsX - 1) {
-						if (m_edgeTable[tableIndex] & 4) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 2);
-							unsigned int id = GetEdgeID(x, y, z, 2);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-						if (m_edgeTable[tableIndex] & 2048) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 11);
-							unsigned int id = GetEdgeID(x, y, z, 11);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-					}
-					if (y == m_nCellsY - 1) {
-						if (m_edgeTable[tableIndex] & 2) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 1);
-							unsigned int id = GetEdgeID(x, y, z, 1);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-						if (m_edgeTable[tableIndex] & 512) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 9);
-							unsigned int id = GetEdgeID(x, y, z, 9);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-					}
-					if (z == m_nCellsZ - 1) {
-						if (m_edgeTable[tableIndex] & 16) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 4);
-							unsigned int id = GetEdgeID(x, y, z, 4);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-						if (m_edgeTable[tableIndex] & 128) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 7);
-							unsigned int id = GetEdgeID(x, y, z, 7);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
+	// Number the vertices of each slab in edge ID order and keep the
+	// cells crossed by the surface. Every point is sampled once, two
+	// planes of inside flags give the edges and cells between them.
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < nSlabs; s++) {
+		SLAB& slab = m_slabs[s];
+		slab.firstPlane = s*nPlanes/nSlabs;
+		slab.lastPlane = (s + 1)*nPlanes/nSlabs;
+		slab.nTriangles = 0;
+		slab.vertices.clear();
+		slab.cells.clear();
+
+		std::vector<unsigned char> below[2];
+		below[0].resize(nPointsInSlice);
+		below[1].resize(nPointsInSlice);
+		ClassifyPlane(below[slab.firstPlane % 2].data(), slab.firstPlane);
+
+		for (unsigned int z = slab.firstPlane; z < slab.lastPlane; z++) {
+			const unsigned char* current = below[z % 2].data();
+			unsigned char* next = below[(z + 1) % 2].data();
+			if (z < m_nCellsZ)
+				ClassifyPlane(next, z + 1);
+
+			for (unsigned int y = 0; y <= m_nCellsY; y++) {
+				// Rows of cells whose corners are all on the same side hold
+				// no crossing edge
+				if (y < m_nCellsY && z < m_nCellsZ) {
+					const unsigned char* rows[4] = { current + y*nPointsInXDirection, current + (y + 1)*nPointsInXDirection, next + y*nPointsInXDirection, next + (y + 1)*nPointsInXDirection };
+					unsigned char any = 0, all = 1;
+					for (unsigned int x = 0; x <= m_nCellsX; x++) {
+						any |= rows[0][x] | rows[1][x] | rows[2][x] | rows[3][x];
+						all &= rows[0][x] & rows[1][x] & rows[2][x] & rows[3][x];
 					}
-					if ((x == m_nCellsX - 1) && (y == m_nCellsY - 1))
-						if (m_edgeTable[tableIndex] & 1024) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 10);
-							unsigned int id = GetEdgeID(x, y, z, 10);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-					if ((x == m_nCellsX - 1) && (z == m_nCellsZ - 1))
-						if (m_edgeTable[tableIndex] & 64) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 6);
-							unsigned int id = GetEdgeID(x, y, z, 6);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-					if ((y == m_nCellsY - 1) && (z == m_nCellsZ - 1))
-						if (m_edgeTable[tableIndex] & 32) {
-							POINT3DID pt = CalculateIntersection(x, y, z, 5);
-							unsigned int id = GetEdgeID(x, y, z, 5);
-							m_i2pt3idVertices.insert(ID2POINT3DID::value_type(id, pt));
-						}
-
-					for (int i = 0; m_triTable[tableIndex][i] != -1; i += 3) {
-						TRIANGLE triangle{};
-						unsigned int pointID0, pointID1, pointID2;
-						pointID0 = GetEdgeID(x, y, z, m_triTable[tableIndex][i]);
-						pointID1 = GetEdgeID(x, y, z, m_triTable[tableIndex][i + 1]);
-						pointID2 = GetEdgeID(x, y, z, m_triTable[tableIndex][i + 2]);
-						triangle.pointID[0] = pointID0;
-						triangle.pointID[1] = pointID1;
-						triangle.pointID[2] = pointID2;
-						m_trivecTriangles.push_back(triangle);
+					if (any == all)
+						continue;
+				}
+
+				for (unsigned int x = 0; x <= m_nCellsX; x++) {
+					unsigned int p = y*nPointsInXDirection + x;
+
+					if (x < m_nCellsX && current[p] != current[p + 1])
+						AddVertex(slab.vertices, x, y, z, 3);
+					if (y < m_nCellsY && current[p] != current[p + nPointsInXDirection])
+						AddVertex(slab.vertices, x, y, z, 0);
+					if (z < m_nCellsZ && current[p] != next[p])
+						AddVertex(slab.vertices, x, y, z, 8);
+
+					if (x == m_nCellsX || y == m_nCellsY || z == m_nCellsZ)
+						continue;
+
+					unsigned int tableIndex =
+						current[p] | current[p + nPointsInXDirection] << 1 | current[p + nPointsInXDirection + 1] << 2 | current[p + 1] << 3 |
+						next[p] << 4 | next[p + nPointsInXDirection] << 5 | next[p + nPointsInXDirection + 1] << 6 | next[p + 1] << 7;
+
+					if (m_edgeTable[tableIndex] != 0) {
+						CELL cell = { x, y, z, tableIndex };
+						slab.cells.push_back(cell);
+						for (int i = 0; m_triTable[tableIndex][i] != -1; i += 3)
+							slab.nTriangles++;
 					}
 				}
 			}
 		}
 	}
 
-	RenameVerticesAndTriangles();
+	// Prefix sum over the slabs gives where each one writes its vertices
+	// and triangles.
+	m_nVertices = 0;
+	m_nTriangles = 0;
+	for (SLAB& slab : m_slabs) {
+		slab.firstVertex = m_nVertices;
+		slab.firstTriangle = m_nTriangles;
+		m_nVertices += slab.vertices.size();
+		m_nTriangles += slab.nTriangles;
+	}
+
+	m_ppt3dVertices = new POINT3D[m_nVertices];
+	m_piTriangleIndices = new unsigned int[m_nTriangles*3];
+
+	// Copy vertices and turn the slab numbering into the final one. The
+	// edge ID of each vertex is kept in newID.
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < nSlabs; s++) {
+		const SLAB& slab = m_slabs[s];
+		for (unsigned int i = 0; i < slab.vertices.size(); i++) {
+			const POINT3DID& vertex = slab.vertices[i];
+			m_ppt3dVertices[slab.firstVertex + i][0] = vertex.x;
+			m_ppt3dVertices[slab.firstVertex + i][1] = vertex.y;
+			m_ppt3dVertices[slab.firstVertex + i][2] = vertex.z;
+			m_edgeVertex[vertex.newID] = slab.firstVertex + i;
+		}
+	}
+
+	// Triangles of the cells kept by each slab, cells of its last plane
+	// read the edges of the next slab.
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < nSlabs; s++) {
+		const SLAB& slab = m_slabs[s];
+		unsigned int* indices = m_piTriangleIndices + 3*slab.firstTriangle;
+
+		for (const CELL& cell : slab.cells)
+			for (int i = 0; m_triTable[cell.tableIndex][i] != -1; i++)
+				*indices++ = m_edgeVertex[GetEdgeID(cell.x, cell.y, cell.z, m_triTable[cell.tableIndex][i])];
+	}
+
+	m_bValidSurface = true;
+}
+
+template <class T> void IsoSurface<T>::UpdateSurface(const T* ptScalarField, const unsigned char* pbDirty, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ)
+{
+	if (m_bValidSurface)
+		DeleteSurface();
+
+	m_tIsoLevel = tIsoLevel;
+	m_nCellsX   = nCellsX;
+	m_nCellsY   = nCellsY;
+	m_nCellsZ   = nCellsZ;
+	m_fCellLengthX  = fCellLengthX;
+	m_fCellLengthY  = fCellLengthY;
+	m_fCellLengthZ  = fCellLengthZ;
+	m_ptScalarField = ptScalarField;
+	m_pSparseField  = NULL;
+
+	// Blocks of points, a block also holds the cells above its points
+	unsigned int nBlocksX = (m_nCellsX + blockSize) >> blockBits;
+	unsigned int nBlocksY = (m_nCellsY + blockSize) >> blockBits;
+	unsigned int nBlocksZ = (m_nCellsZ + blockSize) >> blockBits;
+	unsigned int nBlocks = nBlocksX*nBlocksY*nBlocksZ;
+
+	bool sameGrid = m_chunks.size() == nBlocks && m_nChunkCells[0] == m_nCellsX && m_nChunkCells[1] == m_nCellsY && m_nChunkCells[2] == m_nCellsZ;
+	m_chunks.resize(nBlocks);
+	m_nChunkCells[0] = m_nCellsX;
+	m_nChunkCells[1] = m_nCellsY;
+	m_nChunkCells[2] = m_nCellsZ;
+
+	// Edges and cells of a block read the points of the next blocks
+	std::vector<unsigned int> blocks;
+	for (unsigned int bz = 0; bz < nBlocksZ; bz++)
+		for (unsigned int by = 0; by < nBlocksY; by++)
+			for (unsigned int bx = 0; bx < nBlocksX; bx++) {
+				bool dirty = !sameGrid;
+				for (unsigned int n = 0; n < 8 && !dirty; n++) {
+					unsigned int nx = bx + (n & 1), ny = by + ((n >> 1) & 1), nz = bz + (n >> 2);
+					dirty = nx < nBlocksX && ny < nBlocksY && nz < nBlocksZ && pbDirty[(nz*nBlocksY + ny)*nBlocksX + nx];
+				}
+				if (dirty)
+					blocks.push_back((bz*nBlocksY + by)*nBlocksX + bx);
+			}
+
+#pragma omp parallel for schedule(dynamic)
+	for (int k = 0; k < (int)blocks.size(); k++) {
+		unsigned int b = blocks[k];
+		ExtractBlock(m_chunks[b], b % nBlocksX, (b / nBlocksX) % nBlocksY, b / (nBlocksX*nBlocksY));
+	}
+
+	// Stitch the chunks as the slabs of MarchCubes
+	m_nVertices = 0;
+	m_nTriangles = 0;
+	for (CHUNK& chunk : m_chunks) {
+		chunk.firstVertex = m_nVertices;
+		chunk.firstTriangle = m_nTriangles;
+		m_nVertices += chunk.vertices.size();
+		m_nTriangles += chunk.edges.size()/3;
+	}
+
+	m_ppt3dVertices = new POINT3D[m_nVertices];
+	m_piTriangleIndices = new unsigned int[m_nTriangles*3];
+	m_edgeVertex.resize(3*(m_nCellsX + 1)*(m_nCellsY + 1)*(m_nCellsZ + 1));
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int b = 0; b < (int)nBlocks; b++) {
+		const CHUNK& chunk = m_chunks[b];
+		for (unsigned int i = 0; i < chunk.vertices.size(); i++) {
+			const POINT3DID& vertex = chunk.vertices[i];
+			m_ppt3dVertices[chunk.firstVertex + i][0] = vertex.x;
+			m_ppt3dVertices[chunk.firstVertex + i][1] = vertex.y;
+			m_ppt3dVertices[chunk.firstVertex + i][2] = vertex.z;
+			m_edgeVertex[vertex.newID] = chunk.firstVertex + i;
+		}
+	}
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (int b = 0; b < (int)nBlocks; b++) {
+		const CHUNK& chunk = m_chunks[b];
+		for (unsigned int i = 0; i < chunk.edges.size(); i++)
+			m_piTriangleIndices[3*chunk.firstTriangle + i] = m_edgeVertex[chunk.edges[i]];
+	}
+
 	m_bValidSurface = true;
 }
 
+template <class T> void IsoSurface<T>::ExtractBlock(CHUNK& chunk, unsigned int nBlockX, unsigned int nBlockY, unsigned int nBlockZ)
+{
+	unsigned int x0 = nBlockX << blockBits, y0 = nBlockY << blockBits, z0 = nBlockZ << blockBits;
+	unsigned int x1 = std::min(x0 + blockSize, m_nCellsX), y1 = std::min(y0 + blockSize, m_nCellsY), z1 = std::min(z0 + blockSize, m_nCellsZ);
+
+	chunk.vertices.clear();
+	chunk.edges.clear();
+
+	// Points of the block and the first points of the next blocks
+	const unsigned int n = blockSize + 1;
+	unsigned char below[n*n*n];
+	for (unsigned int z = z0; z <= z1; z++)
+		for (unsigned int y = y0; y <= y1; y++)
+			for (unsigned int x = x0; x <= x1; x++)
+				below[((z - z0)*n + (y - y0))*n + (x - x0)] = Sample(x, y, z) < m_tIsoLevel;
+
+	auto Below = [&](unsigned int x, unsigned int y, unsigned int z) { return below[((z - z0)*n + (y - y0))*n + (x - x0)]; };
+
+	// Vertices on the edges leaving the points of the block, in edge ID
+	// order
+	for (unsigned int z = z0; z <= z1 && z < z0 + blockSize; z++)
+		for (unsigned int y = y0; y <= y1 && y < y0 + blockSize; y++)
+			for (unsigned int x = x0; x <= x1 && x < x0 + blockSize; x++) {
+				unsigned char b = Below(x, y, z);
+				if (x < m_nCellsX && Below(x + 1, y, z) != b)
+					AddVertex(chunk.vertices, x, y, z, 3);
+				if (y < m_nCellsY && Below(x, y + 1, z) != b)
+					AddVertex(chunk.vertices, x, y, z, 0);
+				if (z < m_nCellsZ && Below(x, y, z + 1) != b)
+					AddVertex(chunk.vertices, x, y, z, 8);
+			}
+
+	// Triangles of the cells above these points
+	for (unsigned int z = z0; z < z1; z++)
+		for (unsigned int y = y0; y < y1; y++)
+			for (unsigned int x = x0; x < x1; x++) {
+				unsigned int tableIndex =
+					Below(x, y, z) | Below(x, y + 1, z) << 1 | Below(x + 1, y + 1, z) << 2 | Below(x + 1, y, z) << 3 |
+					Below(x, y, z + 1) << 4 | Below(x, y + 1, z + 1) << 5 | Below(x + 1, y + 1, z + 1) << 6 | Below(x + 1, y, z + 1) << 7;
+
+				for (int i = 0; m_triTable[tableIndex][i] != -1; i++)
+					chunk.edges.push_back(GetEdgeID(x, y, z, m_triTable[tableIndex][i]));
+			}
+}
+
+template <class T> void IsoSurface<T>::ClassifyPlane(unsigned char* pBelow, unsigned int nZ) const
+{
+	unsigned int nPointsInXDirection = (m_nCellsX + 1);
+
+	for (unsigned int y = 0; y <= m_nCellsY; y++) {
+		unsigned char* row = pBelow + y*nPointsInXDirection;
+
+		if (m_ptScalarField) {
+			const T* values = m_ptScalarField + (nZ*(m_nCellsY + 1) + y)*nPointsInXDirection;
+			for (unsigned int x = 0; x <= m_nCellsX; x++)
+				row[x] = values[x] < m_tIsoLevel;
+			continue;
+		}
+
+		for (unsigned int x = 0; x <= m_nCellsX; x++) {
+			// A brick row touching no brick only holds the background
+			if (m_pSparseField && (x % SparseField<T>::brickSize) == 0 && m_pSparseField->emptyRun(x, y, nZ)) {
+				unsigned int last = std::min(x + SparseField<T>::brickSize, m_nCellsX + 1);
+				std::fill(row + x, row + last, 0);
+				x = last - 1;
+				continue;
+			}
+
+			row[x] = Sample(x, y, nZ) < m_tIsoLevel;
+		}
+	}
+}
+
+template <class T> void IsoSurface<T>::AddVertex(std::vector<POINT3DID>& vertices, unsigned int nX, unsigned int nY, unsigned int nZ, unsigned int nEdgeNo)
+{
+	POINT3DID vertex = CalculateIntersection(nX, nY, nZ, nEdgeNo);
+	vertex.newID = GetEdgeID(nX, nY, nZ, nEdgeNo);
+	vertices.push_back(vertex);
+}
+
 template <class T> bool IsoSurface<T>::IsSurfaceValid()
 {
 	return m_bValidSurface;
@@ -483,6 +673,7 @@ template <class T> void IsoSurface<T>::DeleteSurface()
 	}
 
 	m_ptScalarField = NULL;
+	m_pSparseField = NULL;
 	m_tIsoLevel = 0;
 	m_bValidSurface = false;
 }
@@ -614,10 +805,8 @@ template <class T> POINT3DID IsoSurface<T>::CalculateIntersection(unsigned int n
 	y2 = v2y*m_fCellLengthY;
 	z2 = v2z*m_fCellLengthZ;
 
-	unsigned int nPointsInXDirection = (m_nCellsX + 1);
-	unsigned int nPointsInSlice = nPointsInXDirection*(m_nCellsY + 1);
-	T val1 = m_ptScalarField[v1z*nPointsInSlice + v1y*nPointsInXDirection + v1x];
-	T val2 = m_ptScalarField[v2z*nPointsInSlice + v2y*nPointsInXDirection + v2x];
+	T val1 = Sample(v1x, v1y, v1z);
+	T val2 = Sample(v2x, v2y, v2z);
 	POINT3DID intersection = Interpolate(x1, y1, z1, x2, y2, z2, val1, val2);
 	
 	return intersection;
@@ -636,53 +825,7 @@ template <class T> POINT3DID IsoSurface<T>::Interpolate(float fX1, float fY1, fl
 	return interpolation;
 }
 
-template <class T> void IsoSurface<T>::RenameVerticesAndTriangles()
-{
-	unsigned int nextID = 0;
-	ID2POINT3DID::iterator mapIterator = m_i2pt3idVertices.begin();
-	TRIANGLEVECTOR::iterator vecIterator = m_trivecTriangles.begin();
-
-	// Rename vertices.
-	while (mapIterator != m_i2pt3idVertices.end()) {
-		(*mapIterator).second.newID = nextID;
-		nextID++;
-		mapIterator++;
-	}
-
-	// Now rename triangles.
-	while (vecIterator != m_trivecTriangles.end()) {
-		for (unsigned int i = 0; i < 3; i++) {
-			unsigned int newID = m_i2pt3idVertices[(*vecIterator).pointID[i]].newID;
-			(*vecIterator).pointID[i] = newID;
-		}
-		vecIterator++;
-	}
-
-	// Copy all the vertices and triangles into two arrays so that they
-	// can be efficiently accessed.
-	// Copy vertices.
-	mapIterator = m_i2pt3idVertices.begin();
-	m_nVertices = m_i2pt3idVertices.size();
-	m_ppt3dVertices = new POINT3D[m_nVertices];
-	for (unsigned int i = 0; i < m_nVertices; i++, mapIterator++) {
-		m_ppt3dVertices[i][0] = (*mapIterator).second.x;
-		m_ppt3dVertices[i][1] = (*mapIterator).second.y;
-		m_ppt3dVertices[i][2] = (*mapIterator).second.z;
-	}
-	// Copy vertex indices which make triangles.
-	vecIterator = m_trivecTriangles.begin();
-	m_nTriangles = m_trivecTriangles.size();
-	m_piTriangleIndices = new unsigned int[m_nTriangles*3];
-	for (int i = 0; i < m_nTriangles; i++, vecIterator++) {
-		m_piTriangleIndices[i*3] = (*vecIterator).pointID[0];
-		m_piTriangleIndices[i*3+1] = (*vecIterator).pointID[1];
-		m_piTriangleIndices[i*3+2] = (*vecIterator).pointID[2];
-	}
-
-	m_i2pt3idVertices.clear();
-	m_trivecTriangles.clear();
-}
-
 template class IsoSurface<short>;
 template class IsoSurface<unsigned short>;
 template class IsoSurface<float>;
+template class IsoSurface<double>;
@@ -9,24 +9,38 @@
 // IsoSurface can be used to construct an isosurface from a scalar
 // field.
 
-#include <map>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <omp.h>
 #include "Vectors.h"
+#include "SparseField.h"
 
 struct POINT3DID {
 	unsigned int newID;
 	float x, y, z;
 };
 
-typedef std::map<unsigned int, POINT3DID> ID2POINT3DID;
+struct CELL {
+	unsigned int x, y, z, tableIndex;
+};
 
-struct TRIANGLE {
-	unsigned int pointID[3];
+// Point planes along z handled by one thread, with the vertices of the
+// edges leaving them and the cells crossed by the surface.
+struct SLAB {
+	unsigned int firstPlane, lastPlane;
+	unsigned int firstVertex, firstTriangle, nTriangles;
+	std::vector<POINT3DID> vertices;
+	std::vector<CELL> cells;
 };
 
-typedef std::vector<TRIANGLE> TRIANGLEVECTOR;
+// Mesh of a block of cells kept between updates, with the edge ID of each
+// vertex in newID and the triangles as edge IDs.
+struct CHUNK {
+	unsigned int firstVertex, firstTriangle;
+	std::vector<POINT3DID> vertices;
+	std::vector<unsigned int> edges;
+};
 
 template <class T> class IsoSurface {
 public:
@@ -38,6 +52,22 @@ public:
 	// buffer ptScalarField[].
 	void GenerateSurface(const T* ptScalarField, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY,  unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
 
+	// Same from a field stored in bricks, runs of cells touching no
+	// brick are skipped. The background must lie above the isolevel.
+	void GenerateSurface(const SparseField<T>& sparseField, T tIsoLevel, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
+
+	// Points along each axis of the blocks of UpdateSurface.
+	static const unsigned int blockBits = 3;
+	static const unsigned int blockSize = 1 << blockBits;
+
+	// Generates the isosurface block by block and keeps the mesh of each
+	// block. pbDirty holds one flag per block of points, blocks flagged or
+	// touching a flagged block are extracted again, the others reuse their
+	// mesh from the last call. Every block is extracted on the first call
+	// and when the grid changes, the isolevel and cell lengths must stay
+	// the same.
+	void UpdateSurface(const T* ptScalarField, const unsigned char* pbDirty, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
+
 	// Returns true if a valid surface has been generated.
 	bool IsSurfaceValid();
 
@@ -71,11 +101,16 @@ private:
 	/*-----------------------Private class member and functions-----------------------*/
 
 
-	// List of POINT3Ds which form the isosurface.
-	ID2POINT3DID m_i2pt3idVertices;
+	// Slabs of the last surface.
+	std::vector<SLAB> m_slabs;
+
+	// Final vertex index of each edge ID, only valid on edges crossing
+	// the isolevel.
+	std::vector<unsigned int> m_edgeVertex;
 
-	// List of TRIANGLES which form the triangulation of the isosurface.
-	TRIANGLEVECTOR m_trivecTriangles;
+	// Blocks of UpdateSurface, and the grid they were extracted from.
+	std::vector<CHUNK> m_chunks;
+	unsigned int m_nChunkCells[3];
 
 	// Returns the edge ID.
 	unsigned int GetEdgeID(unsigned int nX, unsigned int nY, unsigned int nZ, unsigned int nEdgeNo);
@@ -91,9 +126,25 @@ private:
 	// the isosurface intersects an edge.
 	POINT3DID Interpolate(float fX1, float fY1, float fZ1, float fX2, float fY2, float fZ2, T tVal1, T tVal2);
 
-	// Renames vertices and triangles so that they can be accessed more
-	// efficiently.
-	void RenameVerticesAndTriangles();
+	// Runs marching cubes over every cell of the field set up by
+	// GenerateSurface, slabs along z in parallel.
+	void MarchCubes();
+
+	// Flags the points of a plane lying below the isolevel.
+	void ClassifyPlane(unsigned char* pBelow, unsigned int nZ) const;
+
+	// Appends the intersection with an edge to a list of vertices.
+	void AddVertex(std::vector<POINT3DID>& vertices, unsigned int nX, unsigned int nY, unsigned int nZ, unsigned int nEdgeNo);
+
+	// Extracts the mesh of a block for UpdateSurface.
+	void ExtractBlock(CHUNK& chunk, unsigned int nBlockX, unsigned int nBlockY, unsigned int nBlockZ);
+
+	// Returns the field value at a grid point.
+	inline T Sample(unsigned int nX, unsigned int nY, unsigned int nZ) const {
+		if (m_pSparseField)
+			return m_pSparseField->value(nX, nY, nZ);
+		return m_ptScalarField[(nZ * (m_nCellsY + 1) + nY) * (m_nCellsX + 1) + nX];
+	}
 
 	// No. of cells in x, y, and z directions.
 	unsigned int m_nCellsX, m_nCellsY, m_nCellsZ;
@@ -104,13 +155,18 @@ private:
 	// The buffer holding the scalar field.
 	const T* m_ptScalarField;
 
+	// The bricks holding the scalar field, NULL for a dense buffer.
+	const SparseField<T>* m_pSparseField;
+
 	// The isosurface value.
 	T m_tIsoLevel;
 
 	// Indicates whether a valid surface is present.
 	bool m_bValidSurface;
 
-	// Lookup tables used in the construction of the isosurface.
+	// Lookup tables used in the construction of the isosurface, shared
+	// with FlyingEdges.
+	template <class> friend class FlyingEdges;
 	static const unsigned int m_edgeTable[256];
 	static const unsigned int m_triTable[256][16];
 };
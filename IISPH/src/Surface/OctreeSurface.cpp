@@ -0,0 +1,248 @@
+// Description: This is the implementation file for the OctreeSurface
+// class. Edges are walked from their first point, the four cells around
+// the first cell length of an edge give the leaves around the whole edge
+// since leaves are aligned on their size.
+
+#include "OctreeSurface.h"
+
+template <class T> OctreeSurface<T>::OctreeSurface()
+{
+	m_fCellLengthX = 0;
+	m_fCellLengthY = 0;
+	m_fCellLengthZ = 0;
+	m_nCellsX = 0;
+	m_nCellsY = 0;
+	m_nCellsZ = 0;
+	m_nTriangles = 0;
+	m_nVertices = 0;
+	m_ppt3dVertices = NULL;
+	m_piTriangleIndices = NULL;
+	m_ptScalarField = NULL;
+	m_pLeaves = NULL;
+	m_tIsoLevel = 0;
+	m_bValidSurface = false;
+}
+
+template <class T> OctreeSurface<T>::~OctreeSurface()
+{
+	DeleteSurface();
+}
+
+template <class T> void OctreeSurface<T>::GenerateSurface(const T* ptScalarField, const std::vector<OCTLEAF>& leaves, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ)
+{
+	if (m_bValidSurface)
+		DeleteSurface();
+
+	m_tIsoLevel = tIsoLevel;
+	m_nCellsX   = nCellsX;
+	m_nCellsY   = nCellsY;
+	m_nCellsZ   = nCellsZ;
+	m_fCellLengthX  = fCellLengthX;
+	m_fCellLengthY  = fCellLengthY;
+	m_fCellLengthZ  = fCellLengthZ;
+	m_ptScalarField = ptScalarField;
+	m_pLeaves       = &leaves;
+
+	ContourLeaves();
+}
+
+template <class T> bool OctreeSurface<T>::IsSurfaceValid()
+{
+	return m_bValidSurface;
+}
+
+template <class T> void OctreeSurface<T>::DeleteSurface()
+{
+	m_fCellLengthX = 0;
+	m_fCellLengthY = 0;
+	m_fCellLengthZ = 0;
+	m_nCellsX = 0;
+	m_nCellsY = 0;
+	m_nCellsZ = 0;
+	m_nTriangles = 0;
+	m_nVertices = 0;
+	if (m_ppt3dVertices != NULL) {
+		delete[] m_ppt3dVertices;
+		m_ppt3dVertices = NULL;
+	}
+	if (m_piTriangleIndices != NULL) {
+		delete[] m_piTriangleIndices;
+		m_piTriangleIndices = NULL;
+	}
+
+	m_ptScalarField = NULL;
+	m_pLeaves = NULL;
+	m_tIsoLevel = 0;
+	m_bValidSurface = false;
+}
+
+template <class T> void OctreeSurface<T>::ContourLeaves()
+{
+	const std::vector<OCTLEAF>& leaves = *m_pLeaves;
+	int nLeaves = (int)leaves.size();
+
+	// Leaf of every cell
+	m_cellLeaf.resize(m_nCellsX*m_nCellsY*m_nCellsZ);
+
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int l = 0; l < nLeaves; l++) {
+		const OCTLEAF& leaf = leaves[l];
+		for (unsigned int z = leaf.z; z < leaf.z + leaf.size; z++)
+			for (unsigned int y = leaf.y; y < leaf.y + leaf.size; y++)
+				for (unsigned int x = leaf.x; x < leaf.x + leaf.size; x++)
+					m_cellLeaf[GetCellID(x, y, z)] = l;
+	}
+
+	// Minimal edges crossing the isolevel, a few ranges of leaves per
+	// thread
+	int nRanges = std::max(std::min(nLeaves, 4*omp_get_max_threads()), 1);
+	m_edges.resize(nRanges);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int r = 0; r < nRanges; r++) {
+		m_edges[r].clear();
+		for (int l = r*nLeaves/nRanges; l < (r + 1)*nLeaves/nRanges; l++)
+			AddLeafEdges(m_edges[r], l);
+	}
+
+	// Leaves around a crossing edge hold a vertex, the mean of the
+	// intersections of these edges
+	m_leafSum.assign(3*nLeaves, 0.0f);
+	m_leafVertex.assign(nLeaves, 0);
+
+	m_nTriangles = 0;
+	for (const std::vector<EDGE>& edges : m_edges)
+		for (const EDGE& edge : edges) {
+			for (unsigned int k = 0; k < edge.nLeaves; k++) {
+				unsigned int l = edge.leaves[k];
+				m_leafSum[3*l] += edge.point[0];
+				m_leafSum[3*l + 1] += edge.point[1];
+				m_leafSum[3*l + 2] += edge.point[2];
+				m_leafVertex[l]++;
+			}
+			m_nTriangles += edge.nLeaves - 2;
+		}
+
+	m_nVertices = 0;
+	for (int l = 0; l < nLeaves; l++)
+		if (m_leafVertex[l] > 0)
+			m_nVertices++;
+
+	m_ppt3dVertices = new POINT3D[m_nVertices];
+	m_piTriangleIndices = new unsigned int[m_nTriangles*3];
+
+	unsigned int nVertex = 0;
+	for (int l = 0; l < nLeaves; l++)
+		if (m_leafVertex[l] > 0) {
+			float nIntersections = (float)m_leafVertex[l];
+			m_ppt3dVertices[nVertex][0] = m_leafSum[3*l]/nIntersections*m_fCellLengthX;
+			m_ppt3dVertices[nVertex][1] = m_leafSum[3*l + 1]/nIntersections*m_fCellLengthY;
+			m_ppt3dVertices[nVertex][2] = m_leafSum[3*l + 2]/nIntersections*m_fCellLengthZ;
+			m_leafVertex[l] = nVertex++;
+		}
+
+	// Triangles of each range, a fan over the leaves of each edge
+	std::vector<unsigned int> firstTriangle(nRanges + 1, 0);
+	for (int r = 0; r < nRanges; r++) {
+		firstTriangle[r + 1] = firstTriangle[r];
+		for (const EDGE& edge : m_edges[r])
+			firstTriangle[r + 1] += edge.nLeaves - 2;
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for (int r = 0; r < nRanges; r++) {
+		unsigned int* indices = m_piTriangleIndices + 3*firstTriangle[r];
+		for (const EDGE& edge : m_edges[r])
+			for (unsigned int k = 1; k + 1 < edge.nLeaves; k++) {
+				*indices++ = m_leafVertex[edge.leaves[0]];
+				*indices++ = m_leafVertex[edge.leaves[k]];
+				*indices++ = m_leafVertex[edge.leaves[k + 1]];
+			}
+	}
+
+	m_bValidSurface = true;
+}
+
+template <class T> void OctreeSurface<T>::AddLeafEdges(std::vector<EDGE>& edges, unsigned int nLeaf) const
+{
+	const std::vector<OCTLEAF>& leaves = *m_pLeaves;
+	const OCTLEAF& leaf = leaves[nLeaf];
+	const unsigned int nCells[3] = { m_nCellsX, m_nCellsY, m_nCellsZ };
+	const unsigned int s = leaf.size;
+
+	// Corners below the isolevel, corner (dx, dy, dz) in bit dx + 2 dy +
+	// 4 dz, no edge of the leaf crosses the isolevel when they agree
+	unsigned int corners = 0;
+	for (unsigned int c = 0; c < 8; c++)
+		corners |= (Sample(leaf.x + (c & 1)*s, leaf.y + ((c >> 1) & 1)*s, leaf.z + (c >> 2)*s) < m_tIsoLevel) << c;
+	if (corners == 0 || corners == 255)
+		return;
+
+	// Cells around an edge along axis a, as offsets along the next two
+	// axes u and v, in the order of SurfaceNets
+	static const int around[4][2] = { {0, 0}, {-1, 0}, {-1, -1}, {0, -1} };
+
+	for (unsigned int a = 0; a < 3; a++) {
+		unsigned int u = (a + 1) % 3, v = (a + 2) % 3;
+
+		for (unsigned int e = 0; e < 4; e++) {
+			int p[3] = { (int)leaf.x, (int)leaf.y, (int)leaf.z };
+			p[u] += (e & 1)*s;
+			p[v] += (e >> 1)*s;
+
+			// Edges on the border of the grid join less than four cells
+			if (p[u] == 0 || p[v] == 0 || p[u] == (int)nCells[u] || p[v] == (int)nCells[v])
+				continue;
+
+			unsigned int c1 = ((e & 1) << u) | ((e >> 1) << v), c2 = c1 | (1 << a);
+			bool below = (corners >> c1) & 1;
+			if (below == ((corners >> c2) & 1))
+				continue;
+
+			unsigned int around4[4];
+			bool minimal = true;
+			int owner = -1;
+			for (unsigned int k = 0; k < 4 && minimal; k++) {
+				int c[3] = { p[0], p[1], p[2] };
+				c[u] += around[k][0];
+				c[v] += around[k][1];
+				around4[k] = m_cellLeaf[GetCellID(c[0], c[1], c[2])];
+
+				// A smaller leaf around the edge splits it
+				minimal = leaves[around4[k]].size >= s;
+				if (owner < 0 && leaves[around4[k]].size == s)
+					owner = around4[k];
+			}
+			if (!minimal || owner != (int)nLeaf)
+				continue;
+
+			int q[3] = { p[0], p[1], p[2] };
+			q[a] += s;
+			T value1 = Sample(p[0], p[1], p[2]), value2 = Sample(q[0], q[1], q[2]);
+
+			// Turned around when the first point is outside so that
+			// triangles face the outside as in IsoSurface
+			if (!below)
+				std::swap(around4[1], around4[3]);
+
+			EDGE edge;
+			edge.nLeaves = 0;
+			for (unsigned int k = 0; k < 4; k++)
+				if (around4[k] != around4[(k + 3) % 4])
+					edge.leaves[edge.nLeaves++] = around4[k];
+
+			float mu = float(m_tIsoLevel - value1)/(value2 - value1);
+			for (unsigned int d = 0; d < 3; d++)
+				edge.point[d] = (float)p[d];
+			edge.point[a] += mu*s;
+
+			if (edge.nLeaves >= 3)
+				edges.push_back(edge);
+		}
+	}
+}
+
+template class OctreeSurface<short>;
+template class OctreeSurface<unsigned short>;
+template class OctreeSurface<float>;
+template class OctreeSurface<double>;
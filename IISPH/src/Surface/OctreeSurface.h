@@ -0,0 +1,110 @@
+# pragma once
+// Description: Adaptive isosurface extraction over the leaves of an
+// octree of grid cells, dual as SurfaceNets. A leaf is a cube of 2^k
+// cells and only its corners are read from the field. Every leaf edge
+// holding no smaller leaf edge (a minimal edge, Ju et al. 2002) that
+// crosses the isolevel joins the three or four leaves around it, so that
+// leaves of different sizes stitch without cracks. The vertex of a leaf
+// is the mean of the intersections with the minimal edges around it.
+
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "Vectors.h"
+
+// Leaf of the octree, first cell and size in cells.
+struct OCTLEAF {
+	unsigned int x, y, z, size;
+};
+
+template <class T> class OctreeSurface {
+public:
+	// Constructor and destructor.
+	OctreeSurface();
+	~OctreeSurface();
+
+	// Generates the isosurface over the leaves, which must tile the grid
+	// of nCellsX x nCellsY x nCellsZ cells with cubes aligned on their
+	// size. Only the corners of the leaves are read in ptScalarField[].
+	void GenerateSurface(const T* ptScalarField, const std::vector<OCTLEAF>& leaves, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
+
+	// Returns true if a valid surface has been generated.
+	bool IsSurfaceValid();
+
+	// Deletes the isosurface.
+	void DeleteSurface();
+
+
+
+	/*-----------------------------Output values to be used-----------------------------*/
+
+	// The number of vertices which make up the isosurface.
+	unsigned int m_nVertices;
+
+	// The vertices which make up the isosurface.
+	POINT3D* m_ppt3dVertices;
+
+	// The number of triangles which make up the isosurface.
+	unsigned int m_nTriangles;
+
+	// The indices of the vertices which make up the triangles.
+	unsigned int* m_piTriangleIndices;
+
+
+
+private:
+	/*-----------------------Private class member and functions-----------------------*/
+
+	// Minimal edge crossing the isolevel, with the distinct leaves around
+	// it in polygon order and its intersection in cell units.
+	struct EDGE {
+		unsigned int leaves[4];
+		unsigned int nLeaves;
+		float point[3];
+	};
+
+	// Runs the extraction over the leaves set up by GenerateSurface.
+	void ContourLeaves();
+
+	// Appends the minimal edges of a leaf crossing the isolevel. An edge
+	// belongs to the first leaf of its size around it.
+	void AddLeafEdges(std::vector<EDGE>& edges, unsigned int nLeaf) const;
+
+	// Returns the field value at a grid point.
+	inline T Sample(unsigned int nX, unsigned int nY, unsigned int nZ) const {
+		return m_ptScalarField[(nZ * (m_nCellsY + 1) + nY) * (m_nCellsX + 1) + nX];
+	}
+
+	// Returns the cell ID.
+	inline unsigned int GetCellID(unsigned int nX, unsigned int nY, unsigned int nZ) const {
+		return (nZ * m_nCellsY + nY) * m_nCellsX + nX;
+	}
+
+	// No. of cells in x, y, and z directions.
+	unsigned int m_nCellsX, m_nCellsY, m_nCellsZ;
+
+	// Cell length in x, y, and z directions.
+	float m_fCellLengthX, m_fCellLengthY, m_fCellLengthZ;
+
+	// The buffer holding the scalar field.
+	const T* m_ptScalarField;
+
+	// The leaves of the octree.
+	const std::vector<OCTLEAF>* m_pLeaves;
+
+	// The isosurface value.
+	T m_tIsoLevel;
+
+	// Indicates whether a valid surface is present.
+	bool m_bValidSurface;
+
+	// Leaf holding each cell.
+	std::vector<unsigned int> m_cellLeaf;
+
+	// Edges found in each range of leaves.
+	std::vector< std::vector<EDGE> > m_edges;
+
+	// Sum of the intersections around each leaf, then its vertex.
+	std::vector<float> m_leafSum;
+	std::vector<unsigned int> m_leafVertex;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+// scalar field on the nodes of a grid, stored as 8x8x8 bricks allocated where it is needed
+// the brick table doubles as occupancy mask, nodes of missing bricks read the background value
+template <class T>
+class SparseField {
+public:
+    static const int brickBits  = 3;
+    static const int brickSize  = 1 << brickBits;
+    static const int brickNodes = brickSize * brickSize * brickSize;
+
+    SparseField() {}
+
+    void resize(int nodesX, int nodesY, int nodesZ, T background) {
+        _nodes[0] = nodesX;
+        _nodes[1] = nodesY;
+        _nodes[2] = nodesZ;
+
+        for (int d = 0; d < 3; d++)
+            _bricks[d] = (_nodes[d] + brickSize - 1) >> brickBits;
+
+        _background = background;
+        _table      = std::vector<int>((size_t)_bricks[0] * _bricks[1] * _bricks[2], -1);
+        _active.clear();
+        _values.clear();
+    }
+
+    /*-------------------------------------------Brick allocation-------------------------------------------*/
+
+    // bricks are chosen again every frame, the value pool keeps its capacity
+    void clearBricks() {
+        for (int b : _active)
+            _table[b] = -1;
+        _active.clear();
+    }
+
+    void activateBrick(int bx, int by, int bz) {
+        int b = bx + by * _bricks[0] + bz * _bricks[0] * _bricks[1];
+        if (_table[b] < 0) {
+            _table[b] = (int)_active.size();
+            _active.push_back(b);
+        }
+    }
+
+    // values of the active bricks, reset to the background
+    void allocateBricks() {
+        _values.resize(_active.size() * brickNodes);
+        std::fill(_values.begin(), _values.end(), _background);
+    }
+
+    int activeCount() const { return (int)_active.size(); }
+
+    // first node of the k-th active brick
+    void brickOrigin(int k, int& x, int& y, int& z) const {
+        int b = _active[k];
+        x = (b % _bricks[0]) << brickBits;
+        y = ((b / _bricks[0]) % _bricks[1]) << brickBits;
+        z = (b / (_bricks[0] * _bricks[1])) << brickBits;
+    }
+
+    /*----------------------------------------------Accessors-----------------------------------------------*/
+
+    const inline int  nodes(int d) const { return _nodes[d]; }
+    const inline T    background() const { return _background; }
+    const inline bool inside(int x, int y, int z) const { return x < _nodes[0] && y < _nodes[1] && z < _nodes[2]; }
+
+    // position of a node in the value pool, -1 when its brick is missing
+    inline int slot(int x, int y, int z) const {
+        int b = _table[(x >> brickBits) + (y >> brickBits) * _bricks[0] + (z >> brickBits) * _bricks[0] * _bricks[1]];
+        if (b < 0)
+            return -1;
+        return (b << (3 * brickBits)) + (x & (brickSize - 1)) + ((y & (brickSize - 1)) << brickBits) + ((z & (brickSize - 1)) << (2 * brickBits));
+    }
+
+    inline T value(int x, int y, int z) const {
+        int s = slot(x, y, z);
+        return s < 0 ? _background : _values[s];
+    }
+
+    inline T&       operator[](int slot)       { return _values[slot]; }
+    inline const T& operator[](int slot) const { return _values[slot]; }
+
+    // true when the cells x..x+7 of the brick row, between planes y..y+1 and z..z+1, only touch missing bricks
+    bool emptyRun(int x, int y, int z) const {
+        int bx = x >> brickBits;
+        int lastX = std::min(bx + 1, _bricks[0] - 1);
+        int lastY = std::min((y + 1) >> brickBits, _bricks[1] - 1);
+        int lastZ = std::min((z + 1) >> brickBits, _bricks[2] - 1);
+
+        for (int bz = z >> brickBits; bz <= lastZ; bz++)
+            for (int by = y >> brickBits; by <= lastY; by++)
+                for (int b = bx; b <= lastX; b++)
+                    if (_table[b + by * _bricks[0] + bz * _bricks[0] * _bricks[1]] >= 0)
+                        return false;
+        return true;
+    }
+
+    size_t memoryBytes() const { return _table.size() * sizeof(int) + _values.capacity() * sizeof(T); }
+
+private:
+    int _nodes[3]  = { 0, 0, 0 };   // nodes along each axis
+    int _bricks[3] = { 0, 0, 0 };   // bricks along each axis
+    T   _background = 0;            // value of the nodes of missing bricks
+
+    std::vector<int> _table;        // pool index of each brick, -1 when missing
+    std::vector<int> _active;       // bricks holding values, in pool order
+    std::vector<T>   _values;       // brickNodes values per active brick
+};
@@ -0,0 +1,313 @@
+// Description: This is the implementation file for the SurfaceNets
+// class. The tableIndex of a CELL holds the corners below the isolevel,
+// corner (dx, dy, dz) in bit dx + 2 dy + 4 dz.
+
+#include "SurfaceNets.h"
+
+// Corners at the ends of the 12 edges of a cell, x-edges then y-edges
+// then z-edges.
+static const unsigned int edgeCorners[12][2] = {
+	{0, 1}, {2, 3}, {4, 5}, {6, 7},
+	{0, 2}, {1, 3}, {4, 6}, {5, 7},
+	{0, 4}, {1, 5}, {2, 6}, {3, 7}
+};
+
+template <class T> SurfaceNets<T>::SurfaceNets()
+{
+	m_fCellLengthX = 0;
+	m_fCellLengthY = 0;
+	m_fCellLengthZ = 0;
+	m_nCellsX = 0;
+	m_nCellsY = 0;
+	m_nCellsZ = 0;
+	m_nTriangles = 0;
+	m_nVertices = 0;
+	m_ppt3dVertices = NULL;
+	m_piTriangleIndices = NULL;
+	m_ptScalarField = NULL;
+	m_pSparseField = NULL;
+	m_tIsoLevel = 0;
+	m_bValidSurface = false;
+}
+
+template <class T> SurfaceNets<T>::~SurfaceNets()
+{
+	DeleteSurface();
+}
+
+template <class T> void SurfaceNets<T>::GenerateSurface(const T* ptScalarField, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ)
+{
+	if (m_bValidSurface)
+		DeleteSurface();
+
+	m_tIsoLevel = tIsoLevel;
+	m_nCellsX   = nCellsX;
+	m_nCellsY   = nCellsY;
+	m_nCellsZ   = nCellsZ;
+	m_fCellLengthX  = fCellLengthX;
+	m_fCellLengthY  = fCellLengthY;
+	m_fCellLengthZ  = fCellLengthZ;
+	m_ptScalarField = ptScalarField;
+	m_pSparseField  = NULL;
+
+	BuildNets();
+}
+
+template <class T> void SurfaceNets<T>::GenerateSurface(const SparseField<T>& sparseField, T tIsoLevel, float fCellLengthX, float fCellLengthY, float fCellLengthZ)
+{
+	if (m_bValidSurface)
+		DeleteSurface();
+
+	m_tIsoLevel = tIsoLevel;
+	m_nCellsX   = sparseField.nodes(0) - 1;
+	m_nCellsY   = sparseField.nodes(1) - 1;
+	m_nCellsZ   = sparseField.nodes(2) - 1;
+	m_fCellLengthX  = fCellLengthX;
+	m_fCellLengthY  = fCellLengthY;
+	m_fCellLengthZ  = fCellLengthZ;
+	m_ptScalarField = NULL;
+	m_pSparseField  = &sparseField;
+
+	BuildNets();
+}
+
+template <class T> bool SurfaceNets<T>::IsSurfaceValid()
+{
+	return m_bValidSurface;
+}
+
+template <class T> void SurfaceNets<T>::DeleteSurface()
+{
+	m_fCellLengthX = 0;
+	m_fCellLengthY = 0;
+	m_fCellLengthZ = 0;
+	m_nCellsX = 0;
+	m_nCellsY = 0;
+	m_nCellsZ = 0;
+	m_nTriangles = 0;
+	m_nVertices = 0;
+	if (m_ppt3dVertices != NULL) {
+		delete[] m_ppt3dVertices;
+		m_ppt3dVertices = NULL;
+	}
+	if (m_piTriangleIndices != NULL) {
+		delete[] m_piTriangleIndices;
+		m_piTriangleIndices = NULL;
+	}
+
+	m_ptScalarField = NULL;
+	m_pSparseField = NULL;
+	m_tIsoLevel = 0;
+	m_bValidSurface = false;
+}
+
+template <class T> void SurfaceNets<T>::BuildNets()
+{
+	unsigned int nPointsInXDirection = (m_nCellsX + 1);
+	unsigned int nPointsInSlice = nPointsInXDirection*(m_nCellsY + 1);
+
+	// Slabs of cell planes along z, a few per thread so that empty ones
+	// do not stall the others.
+	int nSlabs = std::min((int)m_nCellsZ, 4*omp_get_max_threads());
+	m_slabs.resize(nSlabs);
+	m_cellVertex.resize(m_nCellsX*m_nCellsY*m_nCellsZ);
+
+	// Vertices of the cells crossed by the isolevel, numbered per slab in
+	// cell ID order, and count of their quads.
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < nSlabs; s++) {
+		SLAB& slab = m_slabs[s];
+		slab.firstPlane = s*m_nCellsZ/nSlabs;
+		slab.lastPlane = (s + 1)*m_nCellsZ/nSlabs;
+		slab.nTriangles = 0;
+		slab.vertices.clear();
+		slab.cells.clear();
+
+		std::vector<unsigned char> below[2];
+		below[0].resize(nPointsInSlice);
+		below[1].resize(nPointsInSlice);
+		ClassifyPlane(below[slab.firstPlane % 2].data(), slab.firstPlane);
+
+		for (unsigned int z = slab.firstPlane; z < slab.lastPlane; z++) {
+			const unsigned char* current = below[z % 2].data();
+			unsigned char* next = below[(z + 1) % 2].data();
+			ClassifyPlane(next, z + 1);
+
+			for (unsigned int y = 0; y < m_nCellsY; y++) {
+				// Rows of cells whose corners are all on the same side hold
+				// no vertex
+				const unsigned char* rows[4] = { current + y*nPointsInXDirection, current + (y + 1)*nPointsInXDirection, next + y*nPointsInXDirection, next + (y + 1)*nPointsInXDirection };
+				unsigned char any = 0, all = 1;
+				for (unsigned int x = 0; x <= m_nCellsX; x++) {
+					any |= rows[0][x] | rows[1][x] | rows[2][x] | rows[3][x];
+					all &= rows[0][x] & rows[1][x] & rows[2][x] & rows[3][x];
+				}
+				if (any == all)
+					continue;
+
+				for (unsigned int x = 0; x < m_nCellsX; x++) {
+					unsigned int corners =
+						rows[0][x] | rows[0][x + 1] << 1 | rows[1][x] << 2 | rows[1][x + 1] << 3 |
+						rows[2][x] << 4 | rows[2][x + 1] << 5 | rows[3][x] << 6 | rows[3][x + 1] << 7;
+
+					if (corners == 0 || corners == 255)
+						continue;
+
+					CELL cell = { x, y, z, corners };
+					slab.cells.push_back(cell);
+					slab.vertices.push_back(CellVertex(x, y, z));
+					slab.nTriangles += 2*CountQuads(cell);
+				}
+			}
+		}
+	}
+
+	// Prefix sum over the slabs gives where each one writes its vertices
+	// and triangles.
+	m_nVertices = 0;
+	m_nTriangles = 0;
+	for (SLAB& slab : m_slabs) {
+		slab.firstVertex = m_nVertices;
+		slab.firstTriangle = m_nTriangles;
+		m_nVertices += slab.vertices.size();
+		m_nTriangles += slab.nTriangles;
+	}
+
+	m_ppt3dVertices = new POINT3D[m_nVertices];
+	m_piTriangleIndices = new unsigned int[m_nTriangles*3];
+
+	// Copy vertices and record the final index of each cell.
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < nSlabs; s++) {
+		const SLAB& slab = m_slabs[s];
+		for (unsigned int i = 0; i < slab.vertices.size(); i++) {
+			const POINT3DID& vertex = slab.vertices[i];
+			m_ppt3dVertices[slab.firstVertex + i][0] = vertex.x;
+			m_ppt3dVertices[slab.firstVertex + i][1] = vertex.y;
+			m_ppt3dVertices[slab.firstVertex + i][2] = vertex.z;
+			m_cellVertex[vertex.newID] = slab.firstVertex + i;
+		}
+	}
+
+	// Quads of each slab, cells of its first plane join cells of the
+	// previous slab.
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < nSlabs; s++) {
+		const SLAB& slab = m_slabs[s];
+		unsigned int* indices = m_piTriangleIndices + 3*slab.firstTriangle;
+
+		for (const CELL& cell : slab.cells)
+			indices = AddQuads(indices, cell);
+	}
+
+	m_bValidSurface = true;
+}
+
+template <class T> void SurfaceNets<T>::ClassifyPlane(unsigned char* pBelow, unsigned int nZ) const
+{
+	unsigned int nPointsInXDirection = (m_nCellsX + 1);
+
+	for (unsigned int y = 0; y <= m_nCellsY; y++) {
+		unsigned char* row = pBelow + y*nPointsInXDirection;
+
+		if (m_ptScalarField) {
+			const T* values = m_ptScalarField + (nZ*(m_nCellsY + 1) + y)*nPointsInXDirection;
+			for (unsigned int x = 0; x <= m_nCellsX; x++)
+				row[x] = values[x] < m_tIsoLevel;
+			continue;
+		}
+
+		for (unsigned int x = 0; x <= m_nCellsX; x++) {
+			// A brick row touching no brick only holds the background
+			if ((x % SparseField<T>::brickSize) == 0 && m_pSparseField->emptyRun(x, y, nZ)) {
+				unsigned int last = std::min(x + SparseField<T>::brickSize, m_nCellsX + 1);
+				std::fill(row + x, row + last, 0);
+				x = last - 1;
+				continue;
+			}
+
+			row[x] = Sample(x, y, nZ) < m_tIsoLevel;
+		}
+	}
+}
+
+template <class T> POINT3DID SurfaceNets<T>::CellVertex(unsigned int nX, unsigned int nY, unsigned int nZ) const
+{
+	T values[8];
+	for (unsigned int c = 0; c < 8; c++)
+		values[c] = Sample(nX + (c & 1), nY + ((c >> 1) & 1), nZ + (c >> 2));
+
+	// Intersections in cell units, from the first corner of the cell
+	float sum[3] = { 0, 0, 0 };
+	unsigned int nIntersections = 0;
+
+	for (unsigned int e = 0; e < 12; e++) {
+		unsigned int c1 = edgeCorners[e][0], c2 = edgeCorners[e][1];
+		if ((values[c1] < m_tIsoLevel) == (values[c2] < m_tIsoLevel))
+			continue;
+
+		float mu = float((m_tIsoLevel - values[c1]))/(values[c2] - values[c1]);
+		for (unsigned int d = 0; d < 3; d++) {
+			float p1 = (c1 >> d) & 1, p2 = (c2 >> d) & 1;
+			sum[d] += p1 + mu*(p2 - p1);
+		}
+		nIntersections++;
+	}
+
+	POINT3DID vertex{};
+	vertex.newID = GetCellID(nX, nY, nZ);
+	vertex.x = (nX + sum[0]/nIntersections)*m_fCellLengthX;
+	vertex.y = (nY + sum[1]/nIntersections)*m_fCellLengthY;
+	vertex.z = (nZ + sum[2]/nIntersections)*m_fCellLengthZ;
+	return vertex;
+}
+
+template <class T> unsigned int SurfaceNets<T>::CountQuads(const CELL& cell) const
+{
+	// Edges along x, y and z from the first corner, joined when the four
+	// cells around them exist
+	unsigned int below = cell.tableIndex & 1, nQuads = 0;
+	if (cell.y > 0 && cell.z > 0 && ((cell.tableIndex >> 1) & 1) != below)
+		nQuads++;
+	if (cell.x > 0 && cell.z > 0 && ((cell.tableIndex >> 2) & 1) != below)
+		nQuads++;
+	if (cell.x > 0 && cell.y > 0 && ((cell.tableIndex >> 4) & 1) != below)
+		nQuads++;
+	return nQuads;
+}
+
+template <class T> unsigned int* SurfaceNets<T>::AddQuads(unsigned int* pIndices, const CELL& cell) const
+{
+	unsigned int x = cell.x, y = cell.y, z = cell.z;
+	unsigned int below = cell.tableIndex & 1;
+
+	// The four cells go around the edge counterclockwise seen from its
+	// second corner, turned around when that corner is the inside one so
+	// that triangles face the outside as in IsoSurface
+	auto addQuad = [&](unsigned int a, unsigned int b, unsigned int c, unsigned int d) {
+		unsigned int quad[4] = { m_cellVertex[a], m_cellVertex[b], m_cellVertex[c], m_cellVertex[d] };
+		if (!below)
+			std::swap(quad[1], quad[3]);
+
+		*pIndices++ = quad[0];
+		*pIndices++ = quad[1];
+		*pIndices++ = quad[2];
+		*pIndices++ = quad[0];
+		*pIndices++ = quad[2];
+		*pIndices++ = quad[3];
+	};
+
+	if (y > 0 && z > 0 && ((cell.tableIndex >> 1) & 1) != below)
+		addQuad(GetCellID(x, y, z), GetCellID(x, y - 1, z), GetCellID(x, y - 1, z - 1), GetCellID(x, y, z - 1));
+	if (x > 0 && z > 0 && ((cell.tableIndex >> 2) & 1) != below)
+		addQuad(GetCellID(x, y, z), GetCellID(x, y, z - 1), GetCellID(x - 1, y, z - 1), GetCellID(x - 1, y, z));
+	if (x > 0 && y > 0 && ((cell.tableIndex >> 4) & 1) != below)
+		addQuad(GetCellID(x, y, z), GetCellID(x - 1, y, z), GetCellID(x - 1, y - 1, z), GetCellID(x, y - 1, z));
+
+	return pIndices;
+}
+
+template class SurfaceNets<short>;
+template class SurfaceNets<unsigned short>;
+template class SurfaceNets<float>;
+template class SurfaceNets<double>;
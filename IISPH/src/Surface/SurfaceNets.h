@@ -0,0 +1,112 @@
+# pragma once
+// Description: Naive Surface Nets isosurface extraction. Dual to
+// marching cubes : every cell crossed by the isolevel holds one vertex,
+// the mean of the intersections with its edges, and every edge crossing
+// the isolevel joins the four cells around it with a quad split into two
+// triangles. About a third of the vertices of IsoSurface on a smoother
+// mesh, with the same outputs. Slabs of cells along z run in parallel
+// as in IsoSurface.
+
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "Vectors.h"
+#include "SparseField.h"
+#include "IsoSurface.h"
+
+template <class T> class SurfaceNets {
+public:
+	// Constructor and destructor.
+	SurfaceNets();
+	~SurfaceNets();
+
+	// Generates the isosurface from the scalar field contained in the
+	// buffer ptScalarField[].
+	void GenerateSurface(const T* ptScalarField, T tIsoLevel, unsigned int nCellsX, unsigned int nCellsY, unsigned int nCellsZ, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
+
+	// Same from a field stored in bricks, runs of cells touching no
+	// brick are skipped. The background must lie above the isolevel.
+	void GenerateSurface(const SparseField<T>& sparseField, T tIsoLevel, float fCellLengthX, float fCellLengthY, float fCellLengthZ);
+
+	// Returns true if a valid surface has been generated.
+	bool IsSurfaceValid();
+
+	// Deletes the isosurface.
+	void DeleteSurface();
+
+
+
+	/*-----------------------------Output values to be used-----------------------------*/
+
+	// The number of vertices which make up the isosurface.
+	unsigned int m_nVertices;
+
+	// The vertices which make up the isosurface.
+	POINT3D* m_ppt3dVertices;
+
+	// The number of triangles which make up the isosurface.
+	unsigned int m_nTriangles;
+
+	// The indices of the vertices which make up the triangles.
+	unsigned int* m_piTriangleIndices;
+
+
+
+private:
+	/*-----------------------Private class member and functions-----------------------*/
+
+	// Runs the extraction over every cell of the field set up by
+	// GenerateSurface.
+	void BuildNets();
+
+	// Flags the points of a plane lying below the isolevel.
+	void ClassifyPlane(unsigned char* pBelow, unsigned int nZ) const;
+
+	// Mean of the intersections of the isolevel with the edges of a cell.
+	POINT3DID CellVertex(unsigned int nX, unsigned int nY, unsigned int nZ) const;
+
+	// Number of quads joining the cells around the edges leaving the
+	// first corner of a cell.
+	unsigned int CountQuads(const CELL& cell) const;
+
+	// Writes the triangles of these quads.
+	unsigned int* AddQuads(unsigned int* pIndices, const CELL& cell) const;
+
+	// Returns the field value at a grid point.
+	inline T Sample(unsigned int nX, unsigned int nY, unsigned int nZ) const {
+		if (m_pSparseField)
+			return m_pSparseField->value(nX, nY, nZ);
+		return m_ptScalarField[(nZ * (m_nCellsY + 1) + nY) * (m_nCellsX + 1) + nX];
+	}
+
+	// Returns the cell ID.
+	inline unsigned int GetCellID(unsigned int nX, unsigned int nY, unsigned int nZ) const {
+		return (nZ * m_nCellsY + nY) * m_nCellsX + nX;
+	}
+
+	// No. of cells in x, y, and z directions.
+	unsigned int m_nCellsX, m_nCellsY, m_nCellsZ;
+
+	// Cell length in x, y, and z directions.
+	float m_fCellLengthX, m_fCellLengthY, m_fCellLengthZ;
+
+	// The buffer holding the scalar field.
+	const T* m_ptScalarField;
+
+	// The bricks holding the scalar field, NULL for a dense buffer.
+	const SparseField<T>* m_pSparseField;
+
+	// The isosurface value.
+	T m_tIsoLevel;
+
+	// Indicates whether a valid surface is present.
+	bool m_bValidSurface;
+
+	// Slabs of the last surface, the cells of a slab are those holding a
+	// vertex.
+	std::vector<SLAB> m_slabs;
+
+	// Vertex index of each cell, only valid on cells crossed by the
+	// isolevel.
+	std::vector<unsigned int> m_cellVertex;
+};
@@ -671,7 +671,9 @@ void VulkanEngine::generateSurfaceMesh() {
     }
     surface.indices.assign(indices, indices + sphSolver.indicesCount());
 
-    surface.laplacianSmooth(3); // post-processing
+    // post-processing, dual meshes already place their vertices at the mean of their cell intersections
+    SurfaceExtraction extraction = sphSolver.surfaceExtraction();
+    surface.laplacianSmooth(extraction == SURFACE_NETS || extraction == ADAPTIVE_OCTREE ? 1 : 3);
     meshes["surface"] = surface;
 }
 
@@ -739,8 +741,8 @@ void VulkanEngine::initParticles() {
     glm::vec3 position{}, color{}, size(sphSolver.particleSpacing() / 3.0f), rotationAxis(0.0f, 1.0f, 0.0f);
     float angle(0.0f);
 
-    // create fluid particles
-    for (int i = 0; i < sphSolver.fluidCount(); i++) {
+    // create fluid particles, one per pool slot
+    for (int i = 0; i < sphSolver.fluidCapacity(); i++) {
         p = sphSolver.fluidPosition(i) - sphSolver.cellSize();
         c = sphSolver.fluidColor(i);
 
@@ -865,8 +867,7 @@ void VulkanEngine::updateScene() {
 }
 
 void VulkanEngine::solveSimulation() {
-    for (int i = 0; i < 2; i++)
-        sphSolver.solveSimulation();
+    sphSolver.advanceFrame(FRAME_DURATION);
 }
 
 void VulkanEngine::updateParticles() {
@@ -881,9 +882,22 @@ void VulkanEngine::updateParticles() {
         position = glm::vec3(p.x, p.y, p.z);
         color = glm::vec3(c.x, c.y, c.z);
 
-        renderables[i + 1].modelMatrix = glm::scale(glm::rotate(glm::translate(glm::mat4(1.0f), position), angle, rotationAxis), size);
+        // free pool slots are hidden, merged particles are drawn bigger
+        glm::vec3 scale = sphSolver.fluidAlive(i) ? size * (sphSolver.fluidSpacing(i) / sphSolver.particleSpacing()) : glm::vec3(0.0f);
+
+        renderables[i + 1].modelMatrix = glm::scale(glm::rotate(glm::translate(glm::mat4(1.0f), position), angle, rotationAxis), scale);
         renderables[i + 1].albedoColor = color;
     }
+
+    if (!sphSolver.movingBoundaries())
+        return;
+
+    for (int i = 0; i < sphSolver.boundaryCount(); i++) {
+        p = sphSolver.boundaryPosition(i) - sphSolver.cellSize();
+        position = glm::vec3(p.x, p.y, p.z);
+
+        renderables[i + 1 + sphSolver.fluidCapacity()].modelMatrix = glm::scale(glm::rotate(glm::translate(glm::mat4(1.0f), position), angle, rotationAxis), size);
+    }
 }
 
 void VulkanEngine::updateSurface() {
@@ -912,7 +926,7 @@ void VulkanEngine::renderScene(VkCommandBuffer commandBuffer) {
         drawSingleObject(commandBuffer, renderables.size() - 3); // surface
 
     if (showBoundaries)
-        drawInstanced(commandBuffer, sphSolver.boundaryCount(), 1 + sphSolver.fluidCount()); // boundary particles
+        drawInstanced(commandBuffer, sphSolver.boundaryCount(), 1 + sphSolver.fluidCapacity()); // boundary particles
 
     drawSingleObject(commandBuffer, renderables.size() - 1); // back wall
 
@@ -1016,7 +1030,7 @@ void VulkanEngine::dropAndSplash() {
 
     // init solver
     Real spacing = 1.0f / 4;
-    sphSolver = IISPHsolver3D(spacing);
+    sphSolver = SPHsolver(spacing);
 
     Real  pCellSize = 2 * spacing;
     Real  sCellSize = spacing / 2;
@@ -1069,6 +1083,9 @@ void VulkanEngine::dropAndSplash() {
         size -= spacing;
     }
 
+    // the step follows the fall speed of the drop, and shrinks on impact
+    sphSolver.setAdaptiveTimeStep(true);
+
     // finish initialization
     sphSolver.prepareSolver(fluidPos, boundaryPos);
 }
@@ -1076,7 +1093,7 @@ void VulkanEngine::dropAndSplash() {
 void VulkanEngine::breakingDam() {
     // init solver
     Real spacing = 1.0f / 4;
-    sphSolver = IISPHsolver3D(spacing);
+    sphSolver = SPHsolver(spacing);
 
     Real  pCellSize = 2 * spacing;
     Real  sCellSize = spacing / 2;
@@ -1163,7 +1180,7 @@ void VulkanEngine::breakingDam() {
 void VulkanEngine::fluidFlow() {
     // init solver
     Real spacing = 1.0f / 4;
-    sphSolver = IISPHsolver3D(spacing);
+    sphSolver = SPHsolver(spacing);
 
     Real  pCellSize = 2 * spacing;
     Real  sCellSize = spacing / 2;
@@ -1243,14 +1260,22 @@ void VulkanEngine::fluidFlow() {
     RenderObject glass{};
     renderables.push_back(glass);
 
+    // continuous flow : the reservoir is refilled from above, spilled fluid is drained around the glass
+    sphSolver.setParticlePool(2 * (int)fluidPos.size());
+    sphSolver.addEmitter(Vec3f(1.0f, gridSize.y - 1.5f, 5.0f), Vec3f(3.0f, gridSize.y - 1.0f, gridSize.z - 5.0f), Vec3f(0.0f, -1.0f, 0.0f));
+    sphSolver.addSink(Vec3f(0.0f), Vec3f(offset.x - radius - pCellSize, 2 * pCellSize, gridSize.z));
+
     // finish initialization
     sphSolver.prepareSolver(fluidPos, boundaryPos);
 }
 
 void VulkanEngine::dynamicBoundaries() {
+    RenderObject object{};
+    renderables.push_back(object);
+
     // init solver
     Real spacing = 1.0f / 4;
-    sphSolver = IISPHsolver3D(spacing);
+    sphSolver = SPHsolver(spacing);
 
     Real  pCellSize = 2 * spacing;
     Real  sCellSize = spacing / 2;
@@ -1262,6 +1287,29 @@ void VulkanEngine::dynamicBoundaries() {
     std::vector<Vec3f> fluidPos = std::vector<Vec3f>();
     std::vector<Vec3f> boundaryPos = std::vector<Vec3f>();
 
+    // fluid tank
+    Vec3f fluidSize(gridSize.x - 2 * pCellSize, 4.0f, gridSize.z - 2 * pCellSize);
+    Sampler::cubeVolume(fluidPos, pCellSize, Vec3f(pCellSize), fluidSize + pCellSize);
+
+    // stirrer : vertical blade turning around the center of the tank
+    std::vector<Vec3f> stirrerPos = std::vector<Vec3f>();
+    Vec3f center(gridSize.x / 2, 0.0f, gridSize.z / 2);
+    Real  bladeLength = gridSize.z / 2 - 4 * pCellSize;
+
+    Vec3f bladeMin(center.x - bladeLength, pCellSize, center.z - pCellSize);
+    Vec3f bladeMax(center.x + bladeLength, 7.0f, center.z + pCellSize);
+    Sampler::cubeSurface(stirrerPos, pCellSize, bladeMin, bladeMax);
+
+    // remove the fluid overlapping the blade
+    std::vector<Vec3f> tankPos = std::vector<Vec3f>();
+    for (Vec3f& p : fluidPos)
+        if (p.x < bladeMin.x - spacing || p.x > bladeMax.x + spacing || p.z < bladeMin.z - spacing || p.z > bladeMax.z + spacing)
+            tankPos.push_back(p);
+    fluidPos = tankPos;
+
+    int stirrer = sphSolver.addBoundaryGroup(stirrerPos, center);
+    sphSolver.setBoundaryMotion(stirrer, Vec3f(0.0f), Vec3f(0.0f, 1.0f, 0.0f));
+
     // finish initialization
     sphSolver.prepareSolver(fluidPos, boundaryPos);
 }
@@ -21,6 +21,10 @@ static const int MAX_OBJECTS_RENDERED  = 500000;
 static const int MAX_MATERIALS_CREATED = 20;
 static const int MAX_FRAMES_IN_FLIGHT  = 2;
 
+static const float FRAME_DURATION = 1.0f / 60; // simulated time between two rendered frames
+
+typedef IISPHsolver3Df SPHsolver; // precision of the simulation (IISPHsolver3Df, IISPHsolver3Dm or IISPHsolver3Dd)
+
 static const std::string SPHERE_MODEL_PATH    = "assets/models/sphere.obj";
 static const std::string CUBE_MODEL_PATH      = "assets/models/cube.obj";
 static const std::string BUNNY_MODEL_PATH     = "assets/models/bunny.obj";
@@ -94,7 +98,7 @@ private:
     std::vector<RenderObject> renderables;
 
     // Logic
-    IISPHsolver3D sphSolver;
+    SPHsolver sphSolver;
     unsigned int frameCount = 1;
     float appTimer          = 0.0f;
     float lastClockTime     = 0.0f;